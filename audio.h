@@ -1,5 +1,7 @@
 #ifdef WIN32
 #include "audiowin.h"
+#elif defined(__linux__)
+#include "audiolnx.h"
 #else
 #include "audiodos.h"
-#endif
+#endif
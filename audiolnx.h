@@ -0,0 +1,308 @@
+#ifndef __AUDIOLNX_H__
+#define __AUDIOLNX_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wavfile.h"
+
+// There is no sound card support for Linux. Instead, audio goes to a sink
+// chosen at runtime with ElegirSalidaAudio(): a WAV file, raw PCM to a file
+// or a pipe, or nowhere at all. A thread plays the part of the sound card:
+// it takes the queued blocks one by one, hands them to the sink, and calls
+// the user function each time a block is done, as the Windows and DOS
+// drivers do. There are MAXAUDIOBUFFERS blocks, playing starts once all of
+// them are queued, and ReproducirAudio() waits for a free one, so playback on a Linux server goes through the very same
+// path it does with a real sound card. The null sink can also keep the time
+// a sound card would, so blocks take as long as they last.
+
+#ifndef MAXAUDIOBUFFERS
+#define MAXAUDIOBUFFERS 4
+#endif
+
+typedef void (*TFuncionCBUsuario)(void *);
+
+// An audio sink: where the blocks go once they are "played"
+typedef struct
+{
+  const char *nombre;
+  int (*abrir) (const char *destino, uint32_t sfreq, int nchannels, int bits);  // returns 0 if OK
+  int (*escribir) (const uint8_t *data, size_t ldata);  // returns 0 if OK
+  void (*cerrar) (void);
+} TSalidaAudio;
+
+static FILE *fsalida = NULL;       // file or pipe the WAV and raw sinks write to
+static uint32_t lsalida;           // bytes written to it
+static uint32_t sfreqsalida;       // format of the audio, for the WAV header
+static int canalessalida, bitssalida;
+
+static int AbrirWav (const char *destino, uint32_t sfreq, int nchannels, int bits)
+{
+  fsalida = fopen (destino, "wb");
+  if (!fsalida)
+    return -1;
+  lsalida = 0;
+  sfreqsalida = sfreq;
+  canalessalida = nchannels;
+  bitssalida = bits;
+  if (!WriteWavHeader (fsalida, sfreq, nchannels, bits, bits == 32, 0xFFFFFFFFUL))  // real size is written when closing
+  {
+    fclose (fsalida);
+    fsalida = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int EscribirFichero (const uint8_t *data, size_t ldata)
+{
+  if (fwrite (data, 1, ldata, fsalida) != ldata)
+    return -1;
+  lsalida += ldata;
+  return 0;
+}
+
+static void CerrarWav (void)
+{
+  if (fseek (fsalida, 0, SEEK_SET) == 0)
+    WriteWavHeader (fsalida, sfreqsalida, canalessalida, bitssalida, bitssalida == 32, lsalida);
+  fclose (fsalida);
+  fsalida = NULL;
+}
+
+static FILE *fsalidaestandar = NULL;  // the real standard output, if the raw sink writes to it (see ElegirSalidaAudio())
+
+static int AbrirRaw (const char *destino, uint32_t sfreq, int nchannels, int bits)
+{
+  if (strcmp (destino, "-") == 0)
+    fsalida = fsalidaestandar;
+  else
+    fsalida = fopen (destino, "wb");  // a named pipe works as well as a file
+  lsalida = 0;
+  return (fsalida != NULL)? 0 : -1;
+}
+
+static void CerrarRaw (void)
+{
+  if (fsalida != fsalidaestandar)
+    fclose (fsalida);
+  else
+    fflush (fsalida);
+  fsalida = NULL;
+}
+
+static int AbrirNulo (const char *destino, uint32_t sfreq, int nchannels, int bits)
+{
+  return 0;
+}
+
+static int EscribirNulo (const uint8_t *data, size_t ldata)
+{
+  return 0;
+}
+
+static void CerrarNulo (void)
+{
+}
+
+static const TSalidaAudio salidas[] =
+{
+  {"wav",  AbrirWav,  EscribirFichero, CerrarWav},
+  {"raw",  AbrirRaw,  EscribirFichero, CerrarRaw},
+  {"null", AbrirNulo, EscribirNulo,    CerrarNulo},
+};
+
+static const TSalidaAudio *salida = NULL;  // sink in use. None until one is chosen
+static char destinosalida[1024];
+static int conreloj = 0;                   // 1 if blocks must take as long as they last
+
+// Description of a block queued for the emulated sound card
+typedef struct
+{
+  uint8_t *p;
+  size_t lbuf;   // bytes in the block
+  size_t tam;    // bytes allocated. Only grows, so there are no allocations once playing
+} TBloqueAudio;
+
+static TBloqueAudio bloques[MAXAUDIOBUFFERS];
+static int primerbloque;   // next block to play
+static int nbloques;       // blocks queued
+static int enmarcha;       // 1 once the queue has been filled for the first time
+static int cerrando;       // 1 if the device thread must end once the queue is empty
+static pthread_mutex_t lockaudio = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cambioaudio = PTHREAD_COND_INITIALIZER;
+static pthread_t hiloaudio;
+static uint32_t bytesporsegundo;
+static TFuncionCBUsuario pfucb = NULL;
+static void *pdatoscb = NULL;
+
+// Function: chooses where audio goes, as "sink[:destination]": wav:file.wav,
+// raw:file (a file or a named pipe; - is the standard output), null, or
+// null:clock (nowhere, but at the pace of a sound card). Returns 1 if the
+// sink exists. If audio goes to the standard output, anything else printed
+// there from now on goes to the standard error instead.
+int ElegirSalidaAudio (const char *spec)
+{
+  const char *dospuntos = strchr (spec, ':');
+  size_t lnombre = dospuntos? (size_t)(dospuntos - spec) : strlen (spec);
+  int i, fd;
+
+  for (i=0; i<(int)(sizeof salidas / sizeof salidas[0]); i++)
+  {
+    if (strlen (salidas[i].nombre) == lnombre && strncmp (spec, salidas[i].nombre, lnombre) == 0)
+    {
+      salida = &salidas[i];
+      snprintf (destinosalida, sizeof destinosalida, "%s", dospuntos? dospuntos+1 : "");
+      conreloj = (salida->escribir == EscribirNulo && strcmp (destinosalida, "clock") == 0);
+      if (salida->abrir == AbrirRaw && strcmp (destinosalida, "-") == 0 && fsalidaestandar == NULL)
+      {
+        fflush (stdout);
+        fd = dup (STDOUT_FILENO);
+        fsalidaestandar = (fd >= 0)? fdopen (fd, "wb") : NULL;
+        dup2 (STDERR_FILENO, STDOUT_FILENO);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Function: the emulated sound card. Plays queued blocks in order, calling
+// the user function after each one, until the device is closed
+static void *HiloAudio (void *arg)
+{
+  struct timespec reloj;
+  TBloqueAudio *b;
+  TFuncionCBUsuario fucb;
+  void *datoscb;
+  uint64_t ns;
+  int parado = 1;
+
+  pthread_mutex_lock (&lockaudio);
+  while (1)
+  {
+    while ((nbloques == 0 || !enmarcha) && !cerrando)
+    {
+      parado = 1;  // nothing to play: a sound card would go silent here
+      pthread_cond_wait (&cambioaudio, &lockaudio);
+    }
+    if (nbloques == 0)
+      break;
+    b = &bloques[primerbloque];
+    pthread_mutex_unlock (&lockaudio);
+
+    salida->escribir (b->p, b->lbuf);
+    if (conreloj)
+    {
+      if (parado)  // starting again: the clock starts from now
+        clock_gettime (CLOCK_MONOTONIC, &reloj);
+      ns = reloj.tv_nsec + (uint64_t)b->lbuf * 1000000000 / bytesporsegundo;
+      reloj.tv_sec += ns / 1000000000;
+      reloj.tv_nsec = ns % 1000000000;
+      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &reloj, NULL) != 0)
+        ;
+    }
+    parado = 0;
+
+    pthread_mutex_lock (&lockaudio);
+    primerbloque = (primerbloque + 1) % MAXAUDIOBUFFERS;
+    nbloques--;
+    fucb = pfucb;
+    datoscb = pdatoscb;
+    pthread_cond_broadcast (&cambioaudio);
+    pthread_mutex_unlock (&lockaudio);
+    if (fucb)   // block done. The user function may queue the next one
+      fucb (datoscb);
+    pthread_mutex_lock (&lockaudio);
+  }
+  pthread_mutex_unlock (&lockaudio);
+  return NULL;
+}
+
+// Function: opens the emulated sound card on the sink chosen with
+// ElegirSalidaAudio(), for nchannels channels of bits bit samples (8 bit
+// unsigned, 16 bit signed, or 32 bit floating point). p is called with
+// datos each time a block is done. Returns 0 if OK.
+int AbrirAudioCallBack (uint32_t sfreq, int nchannels, int bits, TFuncionCBUsuario p, void *datos)
+{
+  if (salida == NULL)  // no sink, no device
+    return -1;
+  if (salida->abrir (destinosalida, sfreq, nchannels, bits) != 0)
+    return -1;
+  bytesporsegundo = sfreq * nchannels * bits / 8;
+  primerbloque = 0;
+  nbloques = 0;
+  enmarcha = 0;
+  cerrando = 0;
+  pfucb = p;
+  pdatoscb = datos;
+  if (pthread_create (&hiloaudio, NULL, HiloAudio, NULL) != 0)
+  {
+    salida->cerrar ();
+    return -1;
+  }
+  return 0;
+}
+
+int AbrirAudio (void)
+{
+  return AbrirAudioCallBack (44100, 1, 8, NULL, NULL);
+}
+
+// Function: waits for all queued blocks to be played, and closes the device
+void CerrarAudio (void)
+{
+  int i;
+
+  pthread_mutex_lock (&lockaudio);
+  pfucb = NULL;
+  cerrando = 1;
+  pthread_cond_broadcast (&cambioaudio);
+  pthread_mutex_unlock (&lockaudio);
+  pthread_join (hiloaudio, NULL);
+  salida->cerrar ();
+  for (i=0; i<MAXAUDIOBUFFERS; i++)
+  {
+    free (bloques[i].p);
+    bloques[i].p = NULL;
+    bloques[i].tam = 0;
+  }
+}
+
+// Function: queues a block of audio samples to be played. If all
+// MAXAUDIOBUFFERS blocks are queued, waits for the one playing to finish
+void ReproducirAudio (uint8_t *data, int ldata)
+{
+  TBloqueAudio *b;
+  uint8_t *p;
+
+  pthread_mutex_lock (&lockaudio);
+  while (nbloques == MAXAUDIOBUFFERS)
+    pthread_cond_wait (&cambioaudio, &lockaudio);
+  b = &bloques[(primerbloque + nbloques) % MAXAUDIOBUFFERS];
+  pthread_mutex_unlock (&lockaudio);  // the device thread doesn't touch free blocks
+
+  if ((size_t)ldata > b->tam)
+  {
+    p = realloc (b->p, ldata);
+    if (!p)
+      return;
+    b->p = p;
+    b->tam = ldata;
+  }
+  memcpy (b->p, data, ldata);
+  b->lbuf = ldata;
+
+  pthread_mutex_lock (&lockaudio);
+  nbloques++;
+  if (nbloques == MAXAUDIOBUFFERS)  // like a sound card, start playing once there is enough to play
+    enmarcha = 1;
+  pthread_cond_broadcast (&cambioaudio);
+  pthread_mutex_unlock (&lockaudio);
+}
+
+#endif
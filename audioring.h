@@ -0,0 +1,89 @@
+#ifndef __AUDIORING_H__
+#define __AUDIORING_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "system.h"
+
+// A ring of audio bytes with a single producer and a single consumer, each
+// one on its own thread (or in an interrupt, as in DOS). No locks: the
+// producer is the only one that moves the write position, and the consumer
+// the only one that moves the read position, so each side just has to
+// publish its position once it's done with the bytes. One byte is always
+// left unused, to tell a full ring from an empty one.
+// The consumer reads in blocks. If the size of the ring is a multiple of
+// the block size, no block read from it ever wraps around, so the consumer
+// can use the bytes where they are instead of copying them out.
+
+typedef struct
+{
+  uint8_t *buf;
+  uint32_t size;       // bytes in buf
+  volatile long rd;    // next byte to read. Only the consumer changes it
+  volatile long wr;    // next byte to write. Only the producer changes it
+} TAudioRing;
+
+// Function: allocates a ring of size bytes. Returns 1 if OK.
+int RingCreate (TAudioRing *r, uint32_t size)
+{
+  r->buf = malloc (size);
+  r->size = size;
+  r->rd = 0;
+  r->wr = 0;
+  return (r->buf != NULL);
+}
+
+void RingDestroy (TAudioRing *r)
+{
+  free (r->buf);
+  r->buf = NULL;
+}
+
+// Function: returns how many bytes are waiting to be read. Either side can
+// call it: the producer gets a lower bound, and the consumer an upper one.
+uint32_t RingUsed (TAudioRing *r)
+{
+  long rd = AtomicLoad (&r->rd);
+  long wr = AtomicLoad (&r->wr);
+
+  return (wr >= rd)? (uint32_t)(wr - rd) : (uint32_t)(r->size - rd + wr);
+}
+
+// Function: producer side. Returns where the next bytes can be written
+// to, and stores in *lspace how many of them fit there without wrapping
+// around. They are not in the ring until RingCommit() is called, so the
+// producer can render into them directly.
+uint8_t *RingSpace (TAudioRing *r, uint32_t *lspace)
+{
+  uint32_t rd = (uint32_t)AtomicLoad (&r->rd);
+  uint32_t wr = (uint32_t)r->wr;
+
+  if (wr >= rd)
+    *lspace = r->size - wr - (rd == 0);  // the last byte stays unused if the reader is at the start
+  else
+    *lspace = rd - wr - 1;
+  return r->buf + wr;
+}
+
+// Function: producer side. Puts ldata bytes written where RingSpace() said
+// into the ring.
+void RingCommit (TAudioRing *r, uint32_t ldata)
+{
+  AtomicStore (&r->wr, ((uint32_t)r->wr + ldata) % r->size);  // the bytes are there before anyone is told
+}
+
+// Function: consumer side. Returns where the next bytes to read are. They
+// stay there until RingSkip() is called.
+const uint8_t *RingPeek (TAudioRing *r)
+{
+  return r->buf + r->rd;
+}
+
+// Function: consumer side. Lets the producer have ldata read bytes back.
+void RingSkip (TAudioRing *r, uint32_t ldata)
+{
+  AtomicStore (&r->rd, ((uint32_t)r->rd + ldata) % r->size);
+}
+
+#endif
@@ -7,17 +7,24 @@
 
 #define SFREQ 44100
 
+#ifndef WAVE_FORMAT_IEEE_FLOAT
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#endif
+
 #ifndef MAXAUDIOBUFFERS
 #define MAXAUDIOBUFFERS 4
 #endif
 
-typedef void (*TFuncionCBUsuario)(void);
+typedef void (*TFuncionCBUsuario)(void *);
 
 static HWAVEOUT wout;
 static WAVEFORMATEX wfx;
 static HANDLE evento_fin_play = 0;
 static WAVEHDR wh[MAXAUDIOBUFFERS];
+static char *bufwh[MAXAUDIOBUFFERS];   // memory for each buffer. Only grows, so there are no allocations once playing
+static DWORD tambufwh[MAXAUDIOBUFFERS];
 static TFuncionCBUsuario pfucb = NULL;
+static void *pdatoscb = NULL;
 
 static void CALLBACK FuncionCallbackAudio (HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
 {
@@ -34,17 +41,20 @@ static void CALLBACK FuncionCallbackAudio (HWAVEOUT hwo, UINT uMsg, DWORD_PTR dw
     lpwh->dwUser = 1;
     SetEvent (evento_fin_play);
     if (pfucb)
-      pfucb();
+      pfucb(pdatoscb);
     break;
   }
 }
 
-int AbrirAudioCallBack (uint32_t sfreq, TFuncionCBUsuario p)
+// Function: opens the audio device for nchannels channels of bits bit
+// samples (8 bit unsigned, 16 bit signed, or 32 bit floating point).
+int AbrirAudioCallBack (uint32_t sfreq, int nchannels, int bits, TFuncionCBUsuario p, void *datos)
 {
   MMRESULT res;
   int i;
   
   pfucb = p;
+  pdatoscb = datos;
   
   evento_fin_play = CreateEvent(0, FALSE, FALSE, 0);
   if (!evento_fin_play)
@@ -56,10 +66,10 @@ int AbrirAudioCallBack (uint32_t sfreq, TFuncionCBUsuario p)
     wh[i].dwUser = 1;
   }
   
-  wfx.wFormatTag = WAVE_FORMAT_PCM;
-  wfx.nChannels = 1;
+  wfx.wFormatTag = (bits == 32)? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+  wfx.nChannels = nchannels;
   wfx.nSamplesPerSec = sfreq;
-  wfx.wBitsPerSample = 8;
+  wfx.wBitsPerSample = bits;
   wfx.nBlockAlign = wfx.nChannels * wfx.wBitsPerSample / 8;
   wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
   wfx.cbSize = 0;
@@ -68,9 +78,16 @@ int AbrirAudioCallBack (uint32_t sfreq, TFuncionCBUsuario p)
   return res;
 }
 
+// Function: the sound card is the only place audio can go to, so there
+// are no other sinks to choose. Returns 0.
+int ElegirSalidaAudio (const char *spec)
+{
+  return 0;
+}
+
 int AbrirAudio (void)
 {
-  return AbrirAudioCallBack (44100, NULL);
+  return AbrirAudioCallBack (44100, 1, 8, NULL, NULL);
 }
 
 void CerrarAudio (void)
@@ -86,18 +103,20 @@ void CerrarAudio (void)
   CloseHandle (evento_fin_play);
   for (i=0; i<MAXAUDIOBUFFERS; i++)
   {
-    if (wh[i].lpData)
-    {
-      free (wh[i].lpData);
-      wh[i].lpData = NULL;
-    }
+    free (bufwh[i]);
+    bufwh[i] = NULL;
+    tambufwh[i] = 0;
+    wh[i].lpData = NULL;
   }
   wout = 0;
 }
 
+// Function: queues a block of audio samples to be played. If all
+// MAXAUDIOBUFFERS buffers are queued, waits for one of them to finish.
 void ReproducirAudio (uint8_t *data, int ldata)
 {
   int i;
+  char *p;
     
   while (1)
   {
@@ -106,9 +125,6 @@ void ReproducirAudio (uint8_t *data, int ldata)
       if (wh[i].dwUser == 1)
       {
         waveOutUnprepareHeader (wout, &wh[i], sizeof wh[i]);
-        if (wh[i].lpData)
-          free (wh[i].lpData);
-        wh[i].lpData = NULL;
         break;
       }
     }
@@ -120,8 +136,16 @@ void ReproducirAudio (uint8_t *data, int ldata)
       break;
   }
 
+  if ((DWORD)ldata > tambufwh[i])  // only the first blocks (or a bigger one) need memory
+  {
+    p = realloc (bufwh[i], ldata);
+    if (!p)
+      return;
+    bufwh[i] = p;
+    tambufwh[i] = ldata;
+  }
   memset (&wh[i], 0, sizeof wh[i]);
-  wh[i].lpData = malloc (ldata * sizeof *wh[i].lpData);
+  wh[i].lpData = bufwh[i];
   memcpy (wh[i].lpData, data, ldata);
   wh[i].dwBufferLength = ldata;
   wh[i].dwLoops = 1;
@@ -15,54 +15,120 @@
 // this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdio.h>
-#include <conio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <mem.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "system.h"
 #include "audio.h"
+#include "wavfile.h"
+#include "workpool.h"
+#include "audioring.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define MIXER_X86   // SSE2 and AVX2 mixers can be built, and chosen at runtime
+#include <immintrin.h>
+#endif
 
 // config option for player. It determines the master clock
 // frequency that, in turn, is used to calculate the phase for the phase-accum
 // counter
 enum {PAL, NTSC};
 
+// Mixing engines. MIXER_REFERENCE is the original sample by sample mixer,
+// kept as the reference every other one must sound identical to. The rest
+// mix one channel at a time, several samples at once.
+enum {MIXER_REFERENCE, MIXER_SCALAR, MIXER_SSE2, MIXER_AVX2, MIXER_AUTO};
+static const char *mixernames[] = {"ref", "scalar", "sse2", "avx2", "auto"};
+
+// Interpolation filters, used to read instruments between two samples. The
+// nearest one is what the original player did: no interpolation at all.
+enum {INTERP_NEAREST, INTERP_LINEAR, INTERP_CUBIC, INTERP_SINC, NUMINTERPS};
+static const char *interpnames[] = {"nearest", "linear", "cubic", "sinc"};
+
+// Output formats: what the sound card gets, or what goes into WAV and raw
+// files. Stereo formats pan channels as an Amiga does: LRRL, LRRL...
+enum {OUTPUT_U8MONO, OUTPUT_S16STEREO, OUTPUT_F32STEREO, NUMOUTPUTS};
+static const char *outputnames[] = {"u8", "s16", "f32"};
+static const int outputchannels[] = {1, 2, 2};
+static const int outputbits[] = {8, 16, 32};   // 32 bit samples are floating point
+
 // Sample information, as read from the MOD file
 typedef struct
 {
   char Samplename[23];
-  size_t Samplelength;  // in bytes, not words as in the file
+  size_t Samplelength;  // in bytes, not words as in the file. Longer than Datalength if the loop has been unrolled
   uint8_t Finetune;     // originally 4 bits, signed, stored as unsigned.
   uint8_t Volume;
   size_t Repeatpoint;   // ditto as Samplelength
   size_t Repeatlength;  // ditto as Samplelength
-  int8_t *Sampledata;
+  size_t Datalength;    // bytes of sample data in the file
+  uint8_t Loopsilent;   // 1 if the loop is silence, as it is for most instruments that don't loop (see PrepareSample())
+  int8_t *Sampledata;   // with SAMPLEGUARD guard samples before and after it (see PrepareSample())
 } TSample;
 
+// Samples are stored with this many guard samples before their start and
+// after their end: as many as the widest interpolation filter reads from
+// outside of the instrument, so no kernel has to check where its taps are
+#define SAMPLEGUARD 4
+
+// Loops shorter than this many bytes are unrolled when the MOD is loaded,
+// so the mixer goes around them less often (see UnrolledLoopLength()). 0
+// means loops are kept as they are in the file
+static size_t minlooplength = 0;
+
+// No sample, guard samples included, gets longer than this by unrolling
+// its loop, so a position in it shifted 15 bits to the left (as the
+// phase-accum counter has it) always fits in 32 bits (see MixRunAVX2()).
+// The longest sample a MOD can have is shorter than this
+#define MAXSAMPLELENGTH ((1 << 17) - 2*SAMPLEGUARD)
+
+// Sample data for MODs loaded with LoadMODProgressive() is read by a thread
+// in the background. This is how it goes.
+#define ALLSAMPLESREADY 256
+typedef struct
+{
+  FILE *f;            // the MOD file, right at the beginning of sample data
+  THandle thread;
+  int threadrunning;  // 1 if the thread could be created
+  int nready;         // how many samples are in memory, from the first one. ALLSAMPLESREADY once finished
+  int cancel;         // set to 1 to stop loading samples
+  TMutex lock;        // for nready and cancel
+  TEvent ready;       // signalled every time nready goes up
+} TSampleLoader;
+
 // Slot information. A slot is each of the 64 divisions in a pattern, for a
-// given channel.
+// given channel. Only what the player needs is kept here, packed in 6 bytes
+// (the file uses 4). Note name and octave for printing are derived from
+// NoteIndex when needed (see NoteName()).
 typedef struct
 {
-  uint8_t Samplenumber;
   uint16_t Noteperiod; // originally 12 bits, zero extended to 16 bits
+  uint8_t Samplenumber;
   uint8_t Effect;
   uint8_t EffectArg;
-  uint8_t NoteIndex;
-  char Note[3];       // string for printing note pitch.
-  uint8_t Octave;     // for printing note octave.
+  uint8_t NoteIndex;   // note (0-35) in the finetune tables closest to Noteperiod
 } TChannelData;
 
-// A row (four slots) in a pattern.
+// A slot that does anything at all, compiled for the sequencer (see
+// CompilePatterns()). Whether it sets the instrument, whether it triggers a
+// note, and which handler its effect has, are all worked out when the MOD
+// is loaded, so the sequencer only has to do what the slot says.
 typedef struct
 {
-  TChannelData chan[4];
-} TRow;
+  TChannelData chd;  // the slot, for the effect handler
+  uint8_t ch;        // channel it's in
+  uint8_t flags;     // CMD_xxxx
+  uint8_t effect;    // index of its handler in effecthandlers[], or NOEFFECT
+} TCommand;
 
-// A pattern (64 rows)
-typedef struct
-{
-  TRow row[64];
-} TPattern;
+#define CMD_SAMPLE 1  // sets the instrument of the channel
+#define CMD_NOTE   2  // triggers a note
+#define NOEFFECT   255
+
+// Most channels a MOD can have
+#define MAXCHANNELS 32
 
 // The while MOD info.
 typedef struct
@@ -71,8 +137,13 @@ typedef struct
   TSample sample[31]; // up to 31 samples
   uint8_t Songpositions[128];  // up to 128 song positions
   uint8_t Songlength;  // how many actual song positions
-  TPattern *pattern; // vector of patterns
-  uint8_t Numpatterns;  // actual number of different patterns
+  TChannelData *pattern; // all patterns: 64 rows of Numchannels slots each. See PatternRow()
+  TCommand *commands;    // all patterns again, compiled for the sequencer (see CompilePatterns())
+  uint32_t *rowcommands; // where the commands of each row start in commands: for tick 0, and for the rest of ticks
+  int Numpatterns;    // actual number of different patterns
+  int Numchannels;    // 1 to MAXCHANNELS
+  int8_t *sampledata; // all the samples, with their guard samples. Sampledata points into it
+  TSampleLoader *loader;  // only for MODs loaded with LoadMODProgressive()
 } TModule;              // (taken from the highest value in Songpositions)
 
 // Information about each audio channel we're playing
@@ -84,7 +155,7 @@ typedef struct
   uint8_t finetune;
   int volume;          // current volume
   int volbase;         // original volume (may be temporary changed by tremolo)
-  TSample *sample;     // pointer to sample info for the sample we're playing
+  const TSample *sample;  // pointer to sample info for the sample we're playing
   size_t position;     // current offset of the sample being outputted to the DAC
   size_t end;          // end offset to detect when we need to repeat
   int pslide;          // amount of periods to slide (up or down, depending upon effect)
@@ -99,11 +170,92 @@ typedef struct
   uint16_t noteperiodslideto;  // target period to reach for Portamento effect (03h)
 } TChanPlay;
 
-// Information about the current state of the MOD being played
+// Options that set how a MOD is to be played. DefaultPlayOptions() fills
+// this with sensible values.
+typedef struct
+{
+  uint32_t sfreq;     // sampling frequency
+  uint8_t format;     // master clock: PAL or NTSC
+  int mixer;          // MIXER_AUTO picks the fastest one this CPU can run
+  int output;         // output format (OUTPUT_xxxx)
+  int separation;     // for stereo output: 100 pans channels hard left or right, 0 puts all of them in the middle
+  int interp;         // interpolation filter (INTERP_xxxx)
+  int startorder;     // where to start playing: division startrow of song position startorder
+  int startrow;       // (0 and 0 is the start of the song) or,
+  uint32_t startms;   // if startorder is -1, this many milliseconds into the song
+  uint32_t highwaterms;  // when playing, how much audio is rendered ahead of the sound card, in milliseconds
+  struct TPlayStats *stats;  // where the player keeps timing statistics. NULL to keep none
+} TPlayOptions;
+
+typedef struct TSeekIndex TSeekIndex;  // see BuildSeekIndex()
+typedef struct TPlayback TPlayback;    // see BeginPlayMOD()
+
+// Where the time of a player goes. The sequencer (which also runs the
+// effects) and the mixer work for the render thread, and the sound card
+// gets the blocks from whoever feeds it (see FeedDevice())
+enum {STAGE_SEQUENCER, STAGE_MIX, STAGE_SUBMIT, NUMSTAGES};
+static const char *stagenames[] = {"sequencer", "mix", "submit"};
+
+// Histograms of times have a bucket for each power of two nanoseconds, up
+// to about 8 ms, and histograms of CPU load one for each 10%, up to 100%
+// and over
+#define STATBUCKETS 24
+#define LOADBUCKETS 11
+
+// Timing statistics of a stage of the player
+typedef struct
+{
+  uint32_t count;     // times it ran
+  uint64_t totalns;   // nanoseconds it took, all in all
+  uint32_t maxns;     // and the most it ever took
+  uint32_t hist[STATBUCKETS];  // hist[i] counts the times that took from 2^i to 2^(i+1)-1 ns
+} TStageStats;
+
+// Statistics a player keeps while it plays, if it is given somewhere to
+// keep them (see TModPlay.stats). Get them with GetPlayStats(). Each thread
+// of the player has its own sequence number, which is odd while it is
+// writing, so a copy can be taken at any time without stopping anybody.
+typedef struct TPlayStats
+{
+  volatile long seqrender;  // for everything but the submit stage
+  volatile long seqdevice;  // for the submit stage
+  TStageStats stage[NUMSTAGES];
+  uint32_t ticks;           // ticks rendered
+  uint32_t lateticks;       // ticks that took longer to render than they last
+  uint64_t renderns;        // time spent rendering ticks
+  uint64_t audions;         // and how long they last. The ratio is the CPU load
+  uint32_t loadhist[LOADBUCKETS];  // CPU load of each tick: 0 to 10%, 10 to 20%... and over 100%
+  uint32_t peakload;        // the highest CPU load of a tick, in thousandths
+  uint64_t tickns;          // time spent on the tick being rendered so far
+  size_t tickframes;        // and how long it is
+  long underruns;           // times the sound card ran dry. Only in copies taken by GetPlayStats()
+} TPlayStats;
+
+// Divisions between snapshots in a seek index, besides the one taken at the
+// start of each song position. More snapshots take more memory, but a seek
+// has less to run from the nearest one
+#define SEEKROWS 16
+
+// Songs that loop forever are indexed for this long when played
+#define SEEKMAXSECONDS 3600
+
+// Information about the current state of the MOD being played. This is the
+// player context: every function that plays a MOD takes one of these, so
+// there can be as many players running at the same time as needed.
 typedef struct
 {
+  const TModule *mod; // the MOD being played. Players never change it, so it can be shared
+  uint8_t samplefinetune[31];  // finetune for each sample. Starts as in the MOD, may be changed by effect E5
+  int samplesready;   // samples known to be in memory, from the first one (see WaitSample())
   uint8_t format;     // format (PAL or NTSC)
   uint32_t sfreq;     // sampling frequency (defaults to 44100 Hz)
+  int mixer;          // which mixing engine to use (MIXER_xxxx)
+  int output;         // output format (OUTPUT_xxxx)
+  int interp;         // interpolation filter (INTERP_xxxx)
+  float outscale;     // to scale the mix bus for stereo output (see ConvertMix())
+  int gainl[MAXCHANNELS];  // gain (x256) of each channel for the left
+  int gainr[MAXCHANNELS];  // and right sides, for stereo output
+  const uint32_t *phases;  // phase for each note period at this sfreq and format. NULL if there is no table
   int finished;       // 1 if MOD has finished playing.
   int newrow;         // 1 if a new division within a pattern has just began
   int newsongpos;     // >=0 if a new position must be loaded into songpos
@@ -118,9 +270,49 @@ typedef struct
   int trwave;         // which wave (square, sine, ramp) we're using for tremolo
   int trretrig;       // 1 if wave position must be resetted on each new division
   size_t tambufplay;  // how many samples to play for this tick
-  TChanPlay chan[4];  // playing state info for each channel.
+  size_t tickleft;    // samples of this tick RenderFrames() has still to render
+  uint32_t frames;    // sample frames generated since the start of the song
+  uint32_t rndseed;   // seed for the random vibrato/tremolo waveform
+  TSeekIndex *seekindex;  // to move to another song position while playing. NULL if there is none
+  TPlayback *playback;  // when playing in the background, the render thread and the ring it fills. NULL if there is none
+  TPlayStats *stats;  // where to keep timing statistics. NULL to keep none, which costs nothing
+  int numchannels;    // as in the MOD
+  TChanPlay chan[MAXCHANNELS];  // playing state info for each channel.
+  volatile long seekorder;  // >=0 if the player must move to this song position before rendering any more (see RenderAhead()).
+                            // Set by the user program at any time, so it's the last field: see CopyPlayer()
 } TModPlay;
 
+// What a scan of a song finds out about it (see ScanMOD())
+typedef struct
+{
+  uint32_t lframes;   // length in sample frames: until it ends or, if it loops, until it jumps back
+  uint32_t nrows;     // how many divisions are played in that time
+  int loops;          // 1 if the song jumps back and would play forever
+  int looporder;      // where the loop starts: song position
+  int looprow;        // and division
+  uint32_t loopframe; // and sample frame
+} TSongScan;
+
+// A snapshot of a player, taken just before it starts division patrow of
+// song position songpos
+typedef struct
+{
+  TModPlay state;
+  int songpos;
+  int patrow;
+} TSeekPoint;
+
+// Snapshots taken all along a song, so a player can be moved anywhere in it
+// without playing it from the start (see SeekMOD())
+struct TSeekIndex
+{
+  TSeekPoint *points;  // in the order they were taken
+  int npoints, maxpoints;
+  uint32_t sfreq;      // the sampling frequency and master clock the song was
+  uint8_t format;      // played at. Players must use the same ones
+  uint32_t lframes;    // length of the song, in sample frames
+};
+
 // sine, ramp down and square waveforms for both vibrato and tremolo
 static int16_t waveforms[3][64] =
 {
@@ -223,41 +415,185 @@ static uint16_t finetune_table[16][36] =
   }
 };
 
-static TModule mod;     // global: the complete MOD file as a structure
-static TModPlay mplay; // global: the current state of the MOD as we're playing
+// Master clocks for the Paula chip in a PAL and a NTSC Amiga
+#define PALCLOCK  3546895LL
+#define NTSCCLOCK 3579545LL
+
+// Note periods are 12 bit values in a MOD file, so phases for the
+// phase-accum counter are kept in tables of this many entries, one table
+// for each sampling frequency and format (PAL/NTSC). A period of 0 has a
+// phase of 0 (the channel stays still) instead of dividing by 0.
+#define MAXPERIOD 4096
+#define PHASE(clk,sfreq,p) ((p)? (uint32_t)((32768LL * (clk)) / ((uint32_t)(sfreq) * (p))) : 0)
+#define PHASES4(clk,sfreq,p)    PHASE(clk,sfreq,p), PHASE(clk,sfreq,(p)+1), PHASE(clk,sfreq,(p)+2), PHASE(clk,sfreq,(p)+3)
+#define PHASES16(clk,sfreq,p)   PHASES4(clk,sfreq,p), PHASES4(clk,sfreq,(p)+4), PHASES4(clk,sfreq,(p)+8), PHASES4(clk,sfreq,(p)+12)
+#define PHASES64(clk,sfreq,p)   PHASES16(clk,sfreq,p), PHASES16(clk,sfreq,(p)+16), PHASES16(clk,sfreq,(p)+32), PHASES16(clk,sfreq,(p)+48)
+#define PHASES256(clk,sfreq,p)  PHASES64(clk,sfreq,p), PHASES64(clk,sfreq,(p)+64), PHASES64(clk,sfreq,(p)+128), PHASES64(clk,sfreq,(p)+192)
+#define PHASES1024(clk,sfreq,p) PHASES256(clk,sfreq,p), PHASES256(clk,sfreq,(p)+256), PHASES256(clk,sfreq,(p)+512), PHASES256(clk,sfreq,(p)+768)
+#define PHASES(clk,sfreq)       {PHASES1024(clk,sfreq,0), PHASES1024(clk,sfreq,1024), PHASES1024(clk,sfreq,2048), PHASES1024(clk,sfreq,3072)}
+
+// Tables for the most used sampling frequencies are built by the compiler
+static const uint32_t phases_pal_32000[MAXPERIOD]  = PHASES(PALCLOCK, 32000);
+static const uint32_t phases_ntsc_32000[MAXPERIOD] = PHASES(NTSCCLOCK, 32000);
+static const uint32_t phases_pal_44100[MAXPERIOD]  = PHASES(PALCLOCK, 44100);
+static const uint32_t phases_ntsc_44100[MAXPERIOD] = PHASES(NTSCCLOCK, 44100);
+static const uint32_t phases_pal_48000[MAXPERIOD]  = PHASES(PALCLOCK, 48000);
+static const uint32_t phases_ntsc_48000[MAXPERIOD] = PHASES(NTSCCLOCK, 48000);
+
+// Tables for any other sampling frequency are built the first time they are
+// needed, and shared by every player from then on. Up to MAXPHASETABLES of
+// them are kept; players at any other frequency just do the division.
+#define MAXPHASETABLES 16
+typedef struct
+{
+  uint32_t sfreq;
+  uint8_t format;
+  const uint32_t *phases;
+} TPhaseTable;
 
-// Function: finds the name and octave for a note, given its noteperiod and
-// stores it into given TChannelData structure (for printing the name of the
-// note while playing)
-void NotePeriodToNoteName (TChannelData *chd)
+static TPhaseTable phasetables[MAXPHASETABLES] =
 {
-  int i;
-  uint16_t ibest;
+  {32000, PAL, phases_pal_32000}, {32000, NTSC, phases_ntsc_32000},
+  {44100, PAL, phases_pal_44100}, {44100, NTSC, phases_ntsc_44100},
+  {48000, PAL, phases_pal_48000}, {48000, NTSC, phases_ntsc_48000}
+};
+static int nphasetables = 6;
+
+// Files are rendered in blocks of this many samples (see RenderFrames())
+#define RENDERBLOCKFRAMES 4096
+
+// The longest a tick can be, in samples: at 32 BPM, the slowest tempo
+#define MAXTICKFRAMES(sfreq) ((sfreq)*15L/(6*32) + 1)
+
+// Channels are mixed into a 32 bit buffer this many samples at a time
+#define MIXCHUNK 256
 
-  char nombres[12][3] = {"C-", "C#", "D-", "D#", "E-", "F-", "F#", "G-", "G#", "A-", "A#", "B-"}; // note names for standard noteperiods (finetune 0)
+// Size in bytes of a sample frame (a sample for each output channel) in the
+// output format output
+#define OutputFrameSize(output) (outputchannels[output] * outputbits[output] / 8)
 
-  if (chd->Noteperiod == 0)  // if no note here, just spaces, and 0 octave
+// Gain (x65536) applied to the mix of more than 4 channels to turn it into
+// an 8 bit sample: 65536 / (128 * sqrt(channels)). See ConvertMix()
+static const int32_t mixgains[MAXCHANNELS+1] =
+{
+  0, 0, 0, 0, 0, 229, 209, 194, 181, 171, 162, 154, 148, 142, 137, 132, 128,
+  124, 121, 117, 114, 112, 109, 107, 105, 102, 100, 99, 97, 95, 93, 92, 91
+};
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Interpolation filters. Each one has a table of coefficients (x16384) for
+// 256 positions between two samples, indexed by the top 8 bits of the 15
+// fractional bits of the phase-accum counter. Rows add up to exactly 16384,
+// and the first row only takes the sample at the current position, so a
+// position with no fraction sounds exactly as it does with no interpolation.
+// Taps go from position-1 to position+2 (cubic) or from position-3 to
+// position+4 (sinc)
+#define INTERPPHASES 256
+static int16_t cubictable[INTERPPHASES][4];
+static int16_t sinctable[INTERPPHASES][8];
+static int interptablesready = 0;
+
+// How many samples after the current position each interpolation
+// filter needs
+static const int interpafter[] = {0, 1, 2, 4};
+
+// Function: rounds a row of ntaps coefficients to x16384 integers, making
+// sure they add up to 16384 by putting the rounding error in the tap with
+// the largest coefficient (the nearest sample)
+void QuantizeInterpRow (const double c[], int16_t row[], int ntaps)
+{
+  int j, jmax, suma;
+
+  jmax = 0;
+  suma = 0;
+  for (j=0; j<ntaps; j++)
   {
-    strcpy (chd->Note, "  ");
-    chd->Octave = 0;
+    row[j] = (int16_t)floor (c[j] * 16384 + 0.5);
+    suma += row[j];
+    if (c[j] > c[jmax])
+      jmax = j;
+  }
+  row[jmax] += 16384 - suma;
+}
+
+// Function: builds the tables for the cubic and sinc filters. Not thread
+// safe: call it once before starting threads that play MODs (InitPlayMOD()
+// calls it)
+void InitInterpTables (void)
+{
+  double c[8], t, x, suma;
+  int i, j;
+
+  if (interptablesready)
     return;
+  for (i=0; i<INTERPPHASES; i++)
+  {
+    t = (double)i / INTERPPHASES;
+    // Catmull-Rom spline through the 4 samples around the position
+    c[0] = (-t*t*t + 2*t*t - t) / 2;
+    c[1] = (3*t*t*t - 5*t*t + 2) / 2;
+    c[2] = (-3*t*t*t + 4*t*t + t) / 2;
+    c[3] = (t*t*t - t*t) / 2;
+    QuantizeInterpRow (c, cubictable[i], 4);
+
+    // sinc, with a Blackman window 8 samples wide, normalized to unity gain
+    suma = 0;
+    for (j=0; j<8; j++)
+    {
+      x = (j - 3) - t;
+      if (x == 0)
+        c[j] = 1;
+      else if (fabs (x) >= 4)
+        c[j] = 0;
+      else
+        c[j] = sin (M_PI * x) / (M_PI * x) * (0.42 + 0.5 * cos (M_PI * x / 4) + 0.08 * cos (M_PI * x / 2));
+      suma += c[j];
+    }
+    for (j=0; j<8; j++)
+      c[j] /= suma;
+    QuantizeInterpRow (c, sinctable[i], 8);
   }
+  interptablesready = 1;
+}
+
+// Mixes a run of n samples from an instrument into mix[], with no looping
+typedef void (*TMixFunc)(const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n);
+
+// Function: finds the note (0 to 35, C-1 to B-3) whose noteperiod is the
+// closest one to the given noteperiod. Returns 0 if there is no note (a
+// noteperiod of 0)
+uint8_t NotePeriodToNoteIndex (uint16_t noteperiod)
+{
+  int i;
+  uint16_t ibest;
+
+  if (noteperiod == 0)  // if no note here, nothing to find
+    return 0;
 
   ibest = 0;
   for (i=0; i<36; i++)  // find most approximate value for finetune 0 (base) option
   {
-    if (chd->Noteperiod == finetune_table[0][i])
+    if (noteperiod == finetune_table[0][i])
       break;
-    if (abs(chd->Noteperiod - finetune_table[0][i]) < abs(chd->Noteperiod - finetune_table[0][ibest]))
+    if (abs(noteperiod - finetune_table[0][i]) < abs(noteperiod - finetune_table[0][ibest]))
       ibest = i;
   }
 
   if (i==36)
     i = ibest;  // if we didn't find an exact match, take the best approximation as result
+  return i;
+}
+
+// Function: returns the name for a note (as returned by NotePeriodToNoteIndex),
+// for printing. Its octave is 1 + noteindex/12
+const char *NoteName (uint8_t noteindex)
+{
+  static const char nombres[12][3] = {"C-", "C#", "D-", "D#", "E-", "F-", "F#", "G-", "G#", "A-", "A#", "B-"}; // note names for standard noteperiods (finetune 0)
 
-  chd->Octave = 1 + i/12;
-  chd->NoteIndex = i;
-  strcpy (chd->Note, nombres[i%12]);
+  return nombres[noteindex % 12];
 }
 
 // Function: ensures a string is null terminated, and ensures that there is
@@ -274,237 +610,993 @@ void Sanitize (char s[], int l)
   }
 }
 
-// Function: loads a MOD file using C standard file functions. Populates
-// "mod" global variable. fname is the full pathname of the MOD.
-int LoadMOD (char fname[])
+// Function: frees all memory allocated by LoadMOD() or LoadMODProgressive()
+// for a MOD
+void FreeMOD (TModule *mod)
 {
-  FILE *f;
-  size_t lfich;
-  uint8_t *buffer;
-  int numsamples;
-  int i, patrow, ch;
-  size_t imod;
+  TSampleLoader *ld = mod->loader;
+  int i;
 
-  f = fopen (fname, "rb");
-  if (!f)
+  if (ld != NULL)  // stop loading samples, if it's still going on
+  {
+    MutexLock (&ld->lock);
+    ld->cancel = 1;
+    MutexUnlock (&ld->lock);
+    if (ld->threadrunning)
+      ThreadJoin (ld->thread);
+    fclose (ld->f);
+    MutexDestroy (&ld->lock);
+    EventDestroy (&ld->ready);
+    free (ld);
+    mod->loader = NULL;
+  }
+  for (i=0; i<31; i++)
+    mod->sample[i].Sampledata = NULL;
+  free (mod->sampledata);
+  mod->sampledata = NULL;
+  free (mod->pattern);
+  mod->pattern = NULL;
+  free (mod->commands);
+  mod->commands = NULL;
+  free (mod->rowcommands);
+  mod->rowcommands = NULL;
+}
+
+// Function: finds out the kind of MOD file from the signature at offset
+// 1080 (buffer must hold the first 1084 bytes, or the whole file if it's
+// shorter): how many instruments and channels it has, and whether its
+// patterns are stored as in FLT8 MODs, where each 8 channel pattern is
+// made of two consecutive 4 channel ones. Anything without a known
+// signature is taken as an old 15 instrument, 4 channel MOD.
+void FormatMOD (const uint8_t *buffer, size_t lfich, int *numsamples, int *numchannels, int *flt8)
+{
+  const uint8_t *sig = buffer + 1080;
+  int n = 0;
+
+  *numsamples = 15;
+  *numchannels = 4;
+  *flt8 = 0;
+  if (lfich < 1084)
+    return;
+
+  if (memcmp (sig, "M.K.", 4)==0 || memcmp (sig, "M!K!", 4)==0 || memcmp (sig, "FLT4", 4)==0)
+    n = 4;
+  else if (memcmp (sig, "FLT8", 4)==0)
+  {
+    n = 8;
+    *flt8 = 1;
+  }
+  else if (memcmp (sig, "OCTA", 4)==0 || memcmp (sig, "CD81", 4)==0)
+    n = 8;
+  else if (sig[0] >= '1' && sig[0] <= '9' && memcmp (sig+1, "CHN", 3)==0)  // 2CHN, 6CHN, 8CHN...
+    n = sig[0] - '0';
+  else if (sig[0] >= '1' && sig[0] <= '3' && sig[1] >= '0' && sig[1] <= '9' && (memcmp (sig+2, "CH", 2)==0 || memcmp (sig+2, "CN", 2)==0))  // 10CH to 32CH
+    n = (sig[0] - '0')*10 + sig[1] - '0';
+  else if (memcmp (sig, "TDZ", 3)==0 && sig[3] >= '1' && sig[3] <= '9')
+    n = sig[3] - '0';
+
+  if (n >= 1 && n <= MAXCHANNELS)
+  {
+    *numsamples = 31;
+    *numchannels = n;
+  }
+  else
+    *flt8 = 0;
+}
+
+// Function: returns the slots of a row of a pattern, one for each channel
+TChannelData *PatternRow (const TModule *mod, int patnum, int patrow)
+{
+  return mod->pattern + ((size_t)patnum*64 + patrow) * mod->Numchannels;
+}
+
+// Function: returns the size of the header of a MOD file (everything before
+// sample data: title, instruments, song positions and patterns), given at
+// least its first 1084 bytes (or the whole file, if it's shorter) in buffer.
+// lfich is the size of the whole file. The result is never beyond lfich.
+size_t HeaderSizeMOD (const uint8_t *buffer, size_t lfich)
+{
+  int numsamples, numchannels, flt8, numpatterns, i;
+  size_t lhead;
+
+  FormatMOD (buffer, lfich, &numsamples, &numchannels, &flt8);
+  lhead = 20 + numsamples*30 + 2;  // title, instruments, song length and the spureous byte
+  if (lhead + 128 > lfich)
+    return lfich;
+  numpatterns = 0;
+  for (i=0; i<128; i++)
+    if (buffer[lhead+i] > numpatterns)
+      numpatterns = buffer[lhead+i];
+  numpatterns = (flt8)? numpatterns/2 + 1 : numpatterns + 1;
+  lhead += 128 + ((numsamples == 31)? 4 : 0) + (size_t)numpatterns * 64 * numchannels * 4;
+  return (lhead > lfich)? lfich : lhead;
+}
+
+// Function: returns the index in effecthandlers[] of the handler for the
+// effect in slot chd: the effect number, except for the miscellaneous
+// effects (14), which go from 16 on, one for each of them
+uint8_t EffectIndex (const TChannelData *chd)
+{
+  return (chd->Effect == 14)? 16 + ((chd->EffectArg >> 4) & 0xF) : chd->Effect;
+}
+
+// Ticks of a division an effect does anything at
+#define TICKFIRST  1   // tick 0
+#define TICKSLATER 2   // any of the others
+
+// Function: tells at which ticks of the division the effect in slot chd
+// does anything at all (TICKFIRST and TICKSLATER), which is 0 for the
+// effects that are not supported. This follows what each DoXxxx() function
+// checks.
+int EffectTicks (const TChannelData *chd)
+{
+  switch (chd->Effect)
+  {
+  case 0:  // arpeggio. With no argument, this is no effect at all
+    return (chd->EffectArg != 0)? TICKSLATER : 0;
+  case 8:
     return 0;
-  fseek (f, 0, SEEK_END); //
-  lfich = ftell(f);       // find out file size
-  fseek (f, 0, SEEK_SET); //
+  case 9:
+    return (chd->EffectArg != 0)? TICKFIRST : 0;
+  case 11:
+  case 12:
+  case 13:
+  case 15:
+    return TICKFIRST;
+  case 14:
+    switch ((chd->EffectArg >> 4) & 0xF)
+    {
+    case 1:
+    case 2:
+    case 10:
+    case 11:
+      return TICKFIRST;
+    case 4:   // these don't look at the tick
+    case 5:
+    case 7:
+    case 13:
+      return TICKFIRST | TICKSLATER;
+    case 9:
+      return ((chd->EffectArg & 0xF) == 0)? TICKFIRST : TICKSLATER;
+    case 12:
+      return TICKSLATER;
+    }
+    return 0;
+  }
+  return TICKFIRST | TICKSLATER;  // tick 0 sets it up, and the other ticks do it
+}
+
+// Function: compiles every pattern of mod into a list of commands for the
+// sequencer. Each row gets two runs of commands, in order of channel: the
+// ones for tick 0 (instruments, notes and effects that do anything then),
+// and the ones for the rest of ticks (just effects). Empty slots, and
+// whatever a slot doesn't do at a given tick, are left out, so a tick
+// where nothing happens takes no work at all. Returns 0 if there is no
+// memory for it.
+int CompilePatterns (TModule *mod)
+{
+  size_t nrows = (size_t)mod->Numpatterns * 64;
+  size_t row, ncommands;
+  const TChannelData *chd;
+  TCommand *c;
+  int ch, ticks, pass;
+
+  mod->rowcommands = malloc ((nrows*2 + 1) * sizeof mod->rowcommands[0]);
+  if (mod->rowcommands == NULL)
+    return 0;
+  for (pass = 0; pass < 2; pass++)  // first count them, then store them
+  {
+    ncommands = 0;
+    for (row = 0; row < nrows; row++)
+    {
+      chd = mod->pattern + row * mod->Numchannels;
+      mod->rowcommands[row*2] = ncommands;
+      for (ch = 0; ch < mod->Numchannels; ch++)
+      {
+        ticks = EffectTicks (&chd[ch]);
+        if (chd[ch].Samplenumber != 0 || (chd[ch].Noteperiod != 0 && chd[ch].Effect != 3 && chd[ch].Effect != 5) || (ticks & TICKFIRST))
+        {
+          if (pass == 1)
+          {
+            c = &mod->commands[ncommands];
+            c->chd = chd[ch];
+            c->ch = ch;
+            c->flags = ((chd[ch].Samplenumber != 0)? CMD_SAMPLE : 0) |
+                       ((chd[ch].Noteperiod != 0 && chd[ch].Effect != 3 && chd[ch].Effect != 5)? CMD_NOTE : 0);  // for 3 and 5 (portamento to note) the note is an argument
+            c->effect = (ticks & TICKFIRST)? EffectIndex (&chd[ch]) : NOEFFECT;
+          }
+          ncommands++;
+        }
+      }
+      mod->rowcommands[row*2 + 1] = ncommands;
+      for (ch = 0; ch < mod->Numchannels; ch++)
+      {
+        if (EffectTicks (&chd[ch]) & TICKSLATER)
+        {
+          if (pass == 1)
+          {
+            c = &mod->commands[ncommands];
+            c->chd = chd[ch];
+            c->ch = ch;
+            c->flags = 0;
+            c->effect = EffectIndex (&chd[ch]);
+          }
+          ncommands++;
+        }
+      }
+    }
+    mod->rowcommands[nrows*2] = ncommands;
+    if (pass == 0)
+    {
+      mod->commands = malloc ((ncommands? ncommands : 1) * sizeof mod->commands[0]);
+      if (mod->commands == NULL)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Function: returns how long the loop of sample s is once unrolled: a loop
+// shorter than minlooplength that goes up to the end of the sample is
+// repeated as many times as it takes to be at least that long. Other loops
+// stay as they are. Inside an unrolled loop the fraction of the phase-accum
+// counter is carried from one time around to the next, instead of being
+// dropped when the loop starts again, so it doesn't sound exactly the same
+// (it's closer to the right pitch, though). That's why it's not done by
+// default. The sample never gets longer than MAXSAMPLELENGTH: the loop is
+// repeated fewer times if needed.
+size_t UnrolledLoopLength (const TSample *s)
+{
+  size_t lloop;
+
+  if (s->Repeatlength == 0 || s->Repeatlength >= minlooplength || s->Repeatpoint + s->Repeatlength != s->Samplelength)
+    return s->Repeatlength;
+  lloop = (minlooplength + s->Repeatlength - 1) / s->Repeatlength * s->Repeatlength;
+  if (s->Repeatpoint + lloop > MAXSAMPLELENGTH)
+    lloop = (MAXSAMPLELENGTH - s->Repeatpoint) / s->Repeatlength * s->Repeatlength;
+  return lloop;
+}
 
-  buffer = malloc(lfich);
-  fread (buffer, 1, lfich, f); // load the while file into memory
-  fclose (f);  // and closes the handle
+// Function: gets sample s ready to be played, once its Datalength bytes
+// from the file are in Sampledata: the first word is set to zero, as the
+// player must do, the loop is unrolled up to Samplelength, and the guard
+// samples are written. The ones before the start are silence, and the ones
+// after the end come from the loop, just as InterpTap() returns them. Last,
+// it finds out whether everything a filter reads while going around the
+// loop is silence.
+void PrepareSample (TSample *s)
+{
+  int8_t *data = s->Sampledata;
+  size_t i, lloop;
+
+  data[0] = 0;
+  if (s->Datalength > 1)
+    data[1] = 0;
+  lloop = s->Datalength - s->Repeatpoint;  // an unrolled loop went up to the end of the sample
+  for (i=s->Datalength; i<s->Samplelength; i++)
+    data[i] = data[i - lloop];
+  memset (data - SAMPLEGUARD, 0, SAMPLEGUARD);
+  for (i=0; i<SAMPLEGUARD; i++)
+    data[s->Samplelength + i] = (s->Repeatlength > 0)? data[s->Repeatpoint + i % s->Repeatlength] : 0;
+  // with no loop at all, the mixer stays at Repeatpoint, and the taps past
+  // it are silence (see InterpTap())
+  s->Loopsilent = 1;
+  for (i=s->Repeatpoint; i<s->Repeatpoint + SAMPLEGUARD + ((s->Repeatlength > 0)? s->Repeatlength : 1); i++)
+    if (data[(ptrdiff_t)i - SAMPLEGUARD] != 0)
+      s->Loopsilent = 0;
+}
+
+// Function: populates the structure pointed by mod with the MOD file in
+// buffer, which is lfich bytes long. Sample data is copied into a block of
+// its own, where each sample has its guard samples around it and its loop
+// unrolled (see PrepareSample()). If withsamples is 0, buffer only holds
+// the header (see HeaderSizeMOD()), and sample data will be read into that
+// block later. Nothing points into buffer afterwards, so the caller can
+// release it. Returns 1 if the MOD was OK.
+int ParseMOD (TModule *mod, uint8_t *buffer, size_t lfich, int withsamples)
+{
+  int numsamples, flt8;
+  int i, patrow, ch;
+  size_t imod, lpatterns, isamples, lsamples, lloop;
+  int8_t *p;
+  const uint8_t *slot;
+
+  if (lfich < 20 + 15*30 + 2 + 128)  // not even the header of a 15 instrument MOD
+    return 0;
 
-  // now we use the copy in memory.
   imod = 0;  // index into memory buffer containing the MOD file.
-  memcpy (mod.Songname, buffer+imod, 20); // song's name
-  Sanitize (mod.Songname, 20);
+  memcpy (mod->Songname, buffer+imod, 20); // song's name
+  Sanitize (mod->Songname, 20);
   imod += 20;
 
-  // check whether this is a 31 instrument MOD, or a 15 instrument MOD.
-  if (memcmp (buffer+1080, "M.K.", 4)==0 || memcmp (buffer+1080, "FLT4", 4)==0)
-    numsamples = 31;
-  else
-    numsamples = 15;  // TODO: I should check whether this is a 8 or 16 channel module, and return
-                      //  with "unsupported" instead of just assuming it's a 4-channel 15 instrument MOD
+  // check whether this is a 31 instrument MOD, or a 15 instrument MOD, and how many channels it has
+  FormatMOD (buffer, lfich, &numsamples, &mod->Numchannels, &flt8);
 
-  // mod.sample is a 31 element vector, holding all the information about a sample (instrument)
-  memset (mod.sample, 0, sizeof mod.sample);  // wipe it
+  // mod->sample is a 31 element vector, holding all the information about a sample (instrument)
+  memset (mod->sample, 0, sizeof mod->sample);  // wipe it
   for (i=0; i<numsamples; i++)
   {
-    memcpy (mod.sample[i].Samplename, buffer+imod, 22);  // ASCIIZ name of instrument
-    Sanitize (mod.sample[i].Samplename, 22);
+    memcpy (mod->sample[i].Samplename, buffer+imod, 22);  // ASCIIZ name of instrument
+    Sanitize (mod->sample[i].Samplename, 22);
 
-    mod.sample[i].Samplelength = 2*(buffer[imod+22]*256+buffer[imod+23]);  // sample length, big endian, word sized, to byte sized, host endian.
-    if (mod.sample[i].Samplelength > 0)  // is this an actual sample, or an empty one?
+    mod->sample[i].Samplelength = 2*(buffer[imod+22]*256+buffer[imod+23]);  // sample length, big endian, word sized, to byte sized, host endian.
+    if (mod->sample[i].Samplelength > 0)  // is this an actual sample, or an empty one?
     {
-      mod.sample[i].Finetune = buffer[imod+24]; // this is a signed 4 bit number, but I will treat is as an unsigned one (see order of finetune_table)
-      mod.sample[i].Volume = buffer[imod+25];  // default volume for sample
-      mod.sample[i].Repeatpoint = 2*(buffer[imod+26]*256+buffer[imod+27]);  // repeat point and repeat length are also converted
-      mod.sample[i].Repeatlength = 2*(buffer[imod+28]*256+buffer[imod+29]); //  from big endian, word sized, to host endian, byte sized
-      mod.sample[i].Sampledata = malloc(mod.sample[i].Samplelength);  // allocate memory for the sample (to be filled later)
+      mod->sample[i].Finetune = buffer[imod+24]; // this is a signed 4 bit number, but I will treat is as an unsigned one (see order of finetune_table)
+      mod->sample[i].Volume = (buffer[imod+25] > 64)? 64 : buffer[imod+25];  // default volume for sample. The mixers need it not above 64
+      mod->sample[i].Repeatpoint = 2*(buffer[imod+26]*256+buffer[imod+27]);  // repeat point and repeat length are also converted
+      mod->sample[i].Repeatlength = 2*(buffer[imod+28]*256+buffer[imod+29]); //  from big endian, word sized, to host endian, byte sized
     }
     imod += 30; // advance 30 bytes in MOD memory buffer.
   }
 
-  mod.Songlength = buffer[imod]; // how many patterns this song has
+  mod->Songlength = buffer[imod]; // how many patterns this song has
   imod += 2;  // skip over the previous data, and a spureous byte nobody knows what it does
-  memcpy (mod.Songpositions, buffer+imod, 128);  // copy over the complete 128 byte vector containing the list of patterns to play
+  memcpy (mod->Songpositions, buffer+imod, 128);  // copy over the complete 128 byte vector containing the list of patterns to play
 
-  // this section finds the biggest pattern number within the list of pattern (mod.Songpositions vector)
-  mod.Numpatterns = mod.Songpositions[0];
+  // this section finds the biggest pattern number within the list of pattern (mod->Songpositions vector)
+  mod->Numpatterns = mod->Songpositions[0];
   for (i=1; i<128; i++)
-    if (mod.Songpositions[i] > mod.Numpatterns)
-      mod.Numpatterns = mod.Songpositions[i];
-  mod.Numpatterns++;  // mod.Numpatterns stores how many different patterns the song has
+    if (mod->Songpositions[i] > mod->Numpatterns)
+      mod->Numpatterns = mod->Songpositions[i];
+  mod->Numpatterns++;  // mod->Numpatterns stores how many different patterns the song has
+  if (flt8)  // song positions count 4 channel patterns. Make them count 8 channel ones
+  {
+    for (i=0; i<128; i++)
+      mod->Songpositions[i] /= 2;
+    mod->Numpatterns = mod->Songpositions[0];
+    for (i=1; i<128; i++)
+      if (mod->Songpositions[i] > mod->Numpatterns)
+        mod->Numpatterns = mod->Songpositions[i];
+    mod->Numpatterns++;
+  }
 
   imod += 128;          // skips over the 128 byte vector, and if
   if (numsamples == 31) // a 31 instrument MOD was detected before, skips over
     imod += 4;          // the 31 instrument mark too (characters M.K. or FLT4)
 
-  mod.pattern = malloc (mod.Numpatterns * sizeof *mod.pattern);  // allocate memory for mod.Numpatterns patterns
-  for (i=0; i<mod.Numpatterns; i++)  // now populate each one of them
+  lpatterns = (size_t)mod->Numpatterns * 64 * mod->Numchannels * 4;  // a pattern is 64 rows of Numchannels channels of 4 bytes
+  if (lfich < imod + lpatterns)
+    return 0;
+
+  mod->pattern = malloc ((size_t)mod->Numpatterns * 64 * mod->Numchannels * sizeof *mod->pattern);  // allocate memory for mod->Numpatterns patterns
+  if (mod->pattern == NULL)
+    return 0;
+  for (i=0; i<mod->Numpatterns; i++)  // now populate each one of them
   {
     for (patrow = 0; patrow<64; patrow++)  // a pattern has always 64 rows or divisions
     {
-      for (ch=0; ch<4; ch++)  // each row/division has info for 4 channels. Each channel has 4 bytes of info.
+      TChannelData *row = PatternRow (mod, i, patrow);
+
+      for (ch=0; ch<mod->Numchannels; ch++)  // each row/division has info for each channel. Each channel has 4 bytes of info.
       {
-        TChannelData *chd = &(mod.pattern[i].row[patrow].chan[ch]);  // pointer to current channel of current row of current pattern, to make coding easier
-        chd->Samplenumber = (buffer[imod] & 0xF0) | ((buffer[imod+2]>>4) & 0x0F);  // sample number is scattered over two different bytes
-        chd->Noteperiod = (buffer[imod] & 0xF)<<8 | buffer[imod+1];  // noteperiod is a 12 bit unsigned data
-        chd->Effect = buffer[imod+2] & 0xF;   // effect number is 4 bits, unsigned
-        chd->EffectArg = buffer[imod+3];  // effect argument is 8 bits
-        NotePeriodToNoteName (chd);   // complete the info for this channel by translating the noteperiod to a note name and a octave, for printing purposes
-        imod += 4;  // we have just processed 4 bytes
+        TChannelData *chd = &row[ch];  // pointer to current channel of current row of current pattern, to make coding easier
+
+        if (flt8)  // channels 1-4 come from the first 4 channel pattern, and 5-8 from the second one
+          slot = buffer + imod + (((size_t)i*2 + ch/4)*64 + patrow)*16 + (ch%4)*4;
+        else
+          slot = buffer + imod + (((size_t)i*64 + patrow)*mod->Numchannels + ch)*4;
+        chd->Samplenumber = (slot[0] & 0xF0) | ((slot[2]>>4) & 0x0F);  // sample number is scattered over two different bytes
+        chd->Noteperiod = (slot[0] & 0xF)<<8 | slot[1];  // noteperiod is a 12 bit unsigned data
+        chd->Effect = slot[2] & 0xF;   // effect number is 4 bits, unsigned
+        chd->EffectArg = slot[3];  // effect argument is 8 bits
+        chd->NoteIndex = NotePeriodToNoteIndex (chd->Noteperiod);   // complete the info for this channel by translating the noteperiod to a note
       }
     }
   }
+  imod += lpatterns;
+  if (!CompilePatterns (mod))
+    return 0;
 
-  // after patterns, sample data is stored sequentially. Now we can at last,
-  // complete mod.sample vector by copying sample data over the allocated memory block
+  // after patterns, sample data is stored sequentially. Now we can at last
+  // complete mod->sample vector, with the size of each sample and its loop
+  // as they will be stored...
+  isamples = imod;
+  lsamples = 0;
   for (i=0; i<numsamples; i++)  // this iterates over 31 or 15 instruments.
   {
-    if (mod.sample[i].Samplelength > 0)  // if there was indeed a sample in this instrument
+    TSample *s = &mod->sample[i];
+
+    if (imod + s->Samplelength > lfich)  // truncated file: keep what's there
+      s->Samplelength = lfich - imod;
+    s->Datalength = s->Samplelength;
+    if (s->Samplelength > 0)  // if there was indeed a sample in this instrument
+    {
+      imod += s->Samplelength;  // and update mod index position
+      // some MODs have loops that go beyond the end of the sample. Keep them
+      // inside it, or the player would read past the end of the sample data
+      if (s->Repeatpoint >= s->Samplelength)
+        s->Repeatpoint = 0;
+      if (s->Repeatpoint + s->Repeatlength > s->Samplelength)
+        s->Repeatlength = s->Samplelength - s->Repeatpoint;
+      lloop = UnrolledLoopLength (s);
+      s->Samplelength += lloop - s->Repeatlength;
+      s->Repeatlength = lloop;
+      lsamples += SAMPLEGUARD + s->Samplelength + SAMPLEGUARD;
+    }
+  }
+
+  // ...and then copy each one to where it goes
+  mod->sampledata = malloc (lsamples? lsamples : 1);
+  if (mod->sampledata == NULL)
+    return 0;
+  imod = isamples;
+  p = mod->sampledata;
+  for (i=0; i<numsamples; i++)
+  {
+    TSample *s = &mod->sample[i];
+
+    if (s->Samplelength > 0)
     {
-      memcpy (mod.sample[i].Sampledata, buffer+imod, mod.sample[i].Samplelength);  // copy it
-      mod.sample[i].Sampledata[0] = 0;    // first word of sample must be
-      mod.sample[i].Sampledata[1] = 0;    // set to zero in player
-      imod += mod.sample[i].Samplelength;  // and update mod index position
+      s->Sampledata = p + SAMPLEGUARD;
+      if (withsamples)
+      {
+        memcpy (s->Sampledata, buffer + imod, s->Datalength);
+        PrepareSample (s);
+      }
+      imod += s->Datalength;
+      p += SAMPLEGUARD + s->Samplelength + SAMPLEGUARD;
     }
   }
 
-  free (buffer);  // the MOD file has been processed and stored in a more
-                  // organized way into memory. The memory buffer that held the
-                  // original MOD file read from disk is no longer needed.
   return 1;
 }
 
-// Function: prints on standard output the info for a pattern division, or row,
-// in a Protracker style. The format used is this:
-// P.RR:  | channel1 data | channel2 data | channel3 data | channel4 data |
-// where P is the pattern number, and RR the row number (0 to 63)
-// Each channelX data has the following format:
-// NNO  II  EAA
-// where: NN is the note name ("C ", "C#", "D ", ..., up to "B "). If no note here, then it's "---"
-//         O is the octave: normally, 1 to 3.
-//        II is the instrument number (1 to 31, decimal). -- if no instrument here
-//        E  is the effect number (0 to F). - if no effect here (effect 0 with null argument)
-//        AA is the effect argument, two hexadecimal digits (or subeffect + agument, for E effect). -- if no argument and no effect.
-void PrintRow (int patnum, int patrow)
+// Function: loads a MOD file by mapping it into memory (see MapFile()).
+// Populates the structure pointed by mod. fname is the full pathname of the
+// MOD. Samples used to be played right from the mapping, with no copies,
+// but now each one needs guard samples around it and may have its loop
+// unrolled after it, where the file has other data: so they are copied
+// out (see ParseMOD()), and the file is unmapped as soon as it's parsed.
+// Once not needed anymore, resources must be released with FreeMOD()
+int LoadMOD (TModule *mod, char fname[])
 {
-  int ch;
+  size_t lfich;
+  uint8_t *buffer;
+  int res;
 
-  printf ("%2d.%2.2d: | ", patnum, patrow);
-  for (ch=0; ch<4; ch++)
+  memset (mod, 0, sizeof *mod);
+  buffer = MapFile (fname, &lfich);  // the whole file is mapped into memory, but
+  if (buffer == NULL)                // only while it's parsed: everything is copied out of it
+    return 0;
+  res = ParseMOD (mod, buffer, lfich, 1);
+  UnmapFile (buffer, lfich);
+  if (res != 1)
   {
-    TChannelData *chd = &(mod.pattern[patnum].row[patrow].chan[ch]);
-
-    if (chd->Noteperiod != 0)
-      printf ("%2.2s%d  ", chd->Note, chd->Octave);
-    else
-      printf ("---  ");
+    FreeMOD (mod);
+    return 0;
+  }
+  return 1;
+}
 
-    if (chd->Samplenumber != 0)
-      printf ("%2.2d  ", chd->Samplenumber);
-    else
-      printf ("--  ");
+// Function: sample data is read in the background by this thread, for MODs
+// loaded with LoadMODProgressive(). Samples are read in the same order they
+// are in the file, and each one is made available as soon as it's complete.
+void SampleLoader (void *arg)
+{
+  TModule *mod = arg;
+  TSampleLoader *ld = mod->loader;
+  TSample *s;
+  size_t l;
+  int i, cancel;
 
-    if (chd->Effect != 0 || chd->EffectArg != 0)  // if effect number and effect argument are 0, no effect here
-      printf ("%1X%2.2X",chd->Effect, chd->EffectArg);
-    else
-      printf ("---");
+  for (i=0; i<31; i++)
+  {
+    MutexLock (&ld->lock);
+    cancel = ld->cancel;
+    MutexUnlock (&ld->lock);
+    if (cancel)
+      break;
 
-    if (ch != 3)
-      printf (" | ");
-    else
-      printf (" |\n");
+    s = &mod->sample[i];
+    if (s->Samplelength > 0)
+    {
+      l = fread (s->Sampledata, 1, s->Datalength, ld->f);
+      if (l < s->Datalength)  // shouldn't happen, as we know the file size. Just in case.
+        memset (s->Sampledata + l, 0, s->Datalength - l);
+      PrepareSample (s);
+    }
+    MutexLock (&ld->lock);
+    ld->nready = i+1;
+    MutexUnlock (&ld->lock);
+    EventSignal (&ld->ready);
   }
+  MutexLock (&ld->lock);
+  ld->nready = ALLSAMPLESREADY;  // also when cancelled, so no one waits for ever
+  MutexUnlock (&ld->lock);
+  EventSignal (&ld->ready);
 }
 
-// Function: prints on the standard out the info for a MOD loaded into the
-// mod structure.
-void InfoMOD (void)
+// Function: loads a MOD file so it can start playing as soon as possible:
+// header, song positions and patterns are read right away, and sample data
+// is read in the background afterwards (or right now, if threads are not
+// available). A player that needs a sample that is not ready yet waits for
+// it (see WaitSample()). Resources must be released with FreeMOD(), which
+// stops the loading if it's not done yet.
+int LoadMODProgressive (TModule *mod, char fname[])
 {
-  int i;
+  TSampleLoader *ld;
+  FILE *f;
+  long lfich;
+  size_t lread, lhead;
+  uint8_t *buffer, *p;
+  int res;
 
-  printf ("Module name              : %s\n", mod.Songname);
-  printf ("Module length            : %d patterns\n", mod.Songlength);
-  printf ("Number of unique patterns: %d\n", mod.Numpatterns);
-  printf ("Pattern sequence         : ");
-  for (i=0; i<mod.Songlength; i++)
-    printf ("%2.2d ", mod.Songpositions[i]);
-  puts("");
+  memset (mod, 0, sizeof *mod);
+  f = fopen (fname, "rb");
+  if (!f)
+    return 0;
+  fseek (f, 0, SEEK_END); //
+  lfich = ftell(f);       // find out file size
+  fseek (f, 0, SEEK_SET); //
 
-  printf ("Samples:\n");
-  for (i=0; i<31; i++)
+  buffer = (lfich > 0)? malloc (1084) : NULL;
+  ld = calloc (1, sizeof *ld);
+  if (buffer == NULL || ld == NULL)
   {
-    if (mod.sample[i].Samplename[0] != 0 || mod.sample[i].Samplelength !=0)
-    {
-      printf ("%-22.22s  V:%2d  L:%5d   R:%5d %5d  F:%+d\n",
-              mod.sample[i].Samplename,
-              mod.sample[i].Volume,
-              mod.sample[i].Samplelength,
-              mod.sample[i].Repeatpoint,
-              mod.sample[i].Repeatlength,
-              (int)((mod.sample[i].Finetune<8)? mod.sample[i].Finetune : mod.sample[i].Finetune-16));
-    }
+    free (buffer);
+    free (ld);
+    fclose (f);
+    return 0;
   }
+  ld->f = f;
+  MutexInit (&ld->lock);
+  EventInit (&ld->ready);
+  mod->loader = ld;
 
-  puts("");
-  /*for (i=0; i<mod.Numpatterns; i++)
+  // the header is read in two steps, as the size of the patterns is not
+  // known until the first 1084 bytes (at most) have been read. Only the
+  // header is ever in buffer, and only until it's parsed.
+  lread = fread (buffer, 1, (lfich < 1084)? lfich : 1084, f);
+  lhead = HeaderSizeMOD (buffer, lfich);
+  if (lhead > lread)
   {
-    int patrow;
-    for (patrow=0; patrow<64; patrow++)
+    p = realloc (buffer, lhead);
+    if (p == NULL)
     {
-      PrintRow (i, patrow);
+      free (buffer);
+      FreeMOD (mod);
+      return 0;
     }
-    puts("");
-  }*/
+    buffer = p;
+    lread += fread (buffer + lread, 1, lhead - lread, f);
+  }
+  res = ParseMOD (mod, buffer, lfich, 0);
+  free (buffer);
+  if (res != 1)
+  {
+    FreeMOD (mod);
+    return 0;
+  }
+  // the file is now right at the beginning of the sample data
+  if (ThreadCreate (&ld->thread, SampleLoader, mod))
+    ld->threadrunning = 1;
+  else
+    SampleLoader (mod);
+  return 1;
 }
 
-
-// A series of small functions that implement each one of the effects
-// For each effect, a test is made to see if we are at tick 0 (beginning of a division)
-// or any other tick, as some effects do some initialization at tick 0, and perform the
-// actual effect in the following ticks.
-
-void DoArpeggio_00 (TChannelData *chd, TChanPlay *chan)
+// Function: waits until the data for sample i (0-30) of mod is in memory.
+// Returns how many samples, counting from the first one, are ready to be
+// played, so the caller doesn't need to ask again for any of them. Each
+// signal of the loader wakes just one waiter, so whoever wakes passes it on
+// to the next one, if any. Without threads, samples are all loaded before
+// anyone can wait for them.
+int WaitSample (const TModule *mod, int i)
 {
-  // Scaled (fixed point) versions of this sequence: for i=0 to 15: pot[i] = 1 / 2^(i/12)
-  // Actually, pot[i] = 2^24 / 2^(i/12). Used to alter the pitch of a note in seminote intervals.
-  static uint64_t pot[16] = {16777216,15835583,14946800,14107900,13316085,
-                             12568710,11863283,11197448,10568983,9975792,
-                             9415894,8887420,8388608,7917791,7473400,7053950};
-  uint16_t newperiod;
+  TSampleLoader *ld = mod->loader;
+  int nready;
 
-  if (mplay.tick != 0)
+  if (ld == NULL)  // MOD was loaded the usual way: everything is in memory
+    return ALLSAMPLESREADY;
+  MutexLock (&ld->lock);
+  nready = ld->nready;
+  MutexUnlock (&ld->lock);
+  if (nready > i)
+    return nready;
+  do
   {
-    if (chd->EffectArg != 0)
+    EventWait (&ld->ready);
+    MutexLock (&ld->lock);
+    nready = ld->nready;
+    MutexUnlock (&ld->lock);
+  }
+  while (nready <= i);
+  EventSignal (&ld->ready);  // for anyone else waiting
+  return nready;
+}
+
+// A parsed MOD in a TModCache, and how many players are using it
+typedef struct TModCacheEntry
+{
+  TModule mod;        // must be the first field: users get a pointer to it
+  uint64_t hash;      // hash of the contents of the MOD file
+  size_t filesize;
+  int refs;           // how many users it has. It can only leave the cache when it's 0
+  struct TModCacheEntry *prev, *next;  // in order of use, most recently used first
+} TModCacheEntry;
+
+// Cache of parsed MODs, shared by any number of players. MODs are found by
+// the contents of their file, not by their name, so the same MOD under two
+// names is loaded once. Players never change a MOD, so all of them can play
+// the same copy at the same time. MODs not used by anyone are kept until
+// there are more than maxmodules in the cache, and then the least recently
+// used ones are dropped.
+typedef struct
+{
+  TModCacheEntry *first, *last;
+  int nmodules;
+  int maxmodules;
+  TMutex lock;
+} TModCache;
+
+// Function: returns a 64 bit hash (FNV-1a) for l bytes at p
+uint64_t HashData (const uint8_t *p, size_t l)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i=0; i<l; i++)
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Function: initializes an empty cache for up to maxmodules unused MODs
+void ModCacheInit (TModCache *c, int maxmodules)
+{
+  c->first = c->last = NULL;
+  c->nmodules = 0;
+  c->maxmodules = maxmodules;
+  MutexInit (&c->lock);
+}
+
+// Function: takes an entry out of the list of a cache
+void ModCacheUnlink (TModCache *c, TModCacheEntry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    c->first = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    c->last = e->prev;
+}
+
+// Function: puts an entry at the front of the list of a cache, as the most
+// recently used one
+void ModCacheLinkFirst (TModCache *c, TModCacheEntry *e)
+{
+  e->prev = NULL;
+  e->next = c->first;
+  if (c->first)
+    c->first->prev = e;
+  else
+    c->last = e;
+  c->first = e;
+}
+
+// Function: looks for a MOD in the cache by the contents of its file. If
+// found, it gets one more user. Must be called with the cache locked.
+TModCacheEntry *ModCacheFind (TModCache *c, uint64_t hash, size_t filesize)
+{
+  TModCacheEntry *e;
+
+  for (e = c->first; e != NULL; e = e->next)
+  {
+    if (e->hash == hash && e->filesize == filesize)
+    {
+      e->refs++;
+      ModCacheUnlink (c, e);
+      ModCacheLinkFirst (c, e);
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Function: drops unused MODs, least recently used first, while there are
+// more than maxmodules in the cache. Must be called with the cache locked.
+void ModCacheTrim (TModCache *c)
+{
+  TModCacheEntry *e, *prev;
+
+  for (e = c->last; e != NULL && c->nmodules > c->maxmodules; e = prev)
+  {
+    prev = e->prev;
+    if (e->refs == 0)
+    {
+      ModCacheUnlink (c, e);
+      c->nmodules--;
+      FreeMOD (&e->mod);
+      free (e);
+    }
+  }
+}
+
+// Function: returns the MOD in file fname from the cache, loading it if
+// it's not there. It must be returned with ModCacheRelease() once it's not
+// needed. Returns NULL if the MOD could not be loaded.
+const TModule *ModCacheLoad (TModCache *c, char fname[])
+{
+  TModCacheEntry *e, *other;
+  uint8_t *buffer;
+  size_t lfich;
+  uint64_t hash;
+  int res;
+
+  buffer = MapFile (fname, &lfich);
+  if (buffer == NULL)
+    return NULL;
+  hash = HashData (buffer, lfich);
+
+  MutexLock (&c->lock);
+  e = ModCacheFind (c, hash, lfich);
+  MutexUnlock (&c->lock);
+  if (e != NULL)  // already loaded: this copy of the file is not needed
+  {
+    UnmapFile (buffer, lfich);
+    return &e->mod;
+  }
+
+  // it's parsed without holding the lock, so other players are not kept
+  // waiting. If someone else loads the same MOD meanwhile, theirs is used.
+  e = malloc (sizeof *e);
+  if (e == NULL)
+  {
+    UnmapFile (buffer, lfich);
+    return NULL;
+  }
+  memset (&e->mod, 0, sizeof e->mod);
+  res = ParseMOD (&e->mod, buffer, lfich, 1);
+  UnmapFile (buffer, lfich);  // the hash is all that's needed from it now
+  if (res != 1)
+  {
+    FreeMOD (&e->mod);
+    free (e);
+    return NULL;
+  }
+  e->hash = hash;
+  e->filesize = lfich;
+  e->refs = 1;
+
+  MutexLock (&c->lock);
+  other = ModCacheFind (c, hash, lfich);
+  if (other == NULL)
+  {
+    ModCacheLinkFirst (c, e);
+    c->nmodules++;
+    ModCacheTrim (c);
+  }
+  MutexUnlock (&c->lock);
+  if (other != NULL)
+  {
+    FreeMOD (&e->mod);
+    free (e);
+    e = other;
+  }
+  return &e->mod;
+}
+
+// Function: tells the cache that a MOD returned by ModCacheLoad() is not
+// being used anymore
+void ModCacheRelease (TModCache *c, const TModule *mod)
+{
+  TModCacheEntry *e = (TModCacheEntry *)mod;
+
+  MutexLock (&c->lock);
+  e->refs--;
+  ModCacheTrim (c);
+  MutexUnlock (&c->lock);
+}
+
+// Function: frees every MOD in the cache. None of them can be in use.
+void ModCacheFree (TModCache *c)
+{
+  TModCacheEntry *e, *next;
+
+  for (e = c->first; e != NULL; e = next)
+  {
+    next = e->next;
+    FreeMOD (&e->mod);
+    free (e);
+  }
+  c->first = c->last = NULL;
+  c->nmodules = 0;
+  MutexDestroy (&c->lock);
+}
+
+// Function: prints on standard output the info for a pattern division, or row,
+// in a Protracker style. The format used is this:
+// P.RR:  | channel1 data | channel2 data | channel3 data | channel4 data |
+// where P is the pattern number, and RR the row number (0 to 63)
+// Each channelX data has the following format:
+// NNO  II  EAA
+// where: NN is the note name ("C ", "C#", "D ", ..., up to "B "). If no note here, then it's "---"
+//         O is the octave: normally, 1 to 3.
+//        II is the instrument number (1 to 31, decimal). -- if no instrument here
+//        E  is the effect number (0 to F). - if no effect here (effect 0 with null argument)
+//        AA is the effect argument, two hexadecimal digits (or subeffect + agument, for E effect). -- if no argument and no effect.
+void PrintRow (const TModule *mod, int patnum, int patrow)
+{
+  int ch;
+
+  printf ("%2d.%2.2d: | ", patnum, patrow);
+  for (ch=0; ch<mod->Numchannels; ch++)
+  {
+    const TChannelData *chd = &PatternRow (mod, patnum, patrow)[ch];
+
+    if (chd->Noteperiod != 0)
+      printf ("%2.2s%d  ", NoteName (chd->NoteIndex), 1 + chd->NoteIndex/12);
+    else
+      printf ("---  ");
+
+    if (chd->Samplenumber != 0)
+      printf ("%2.2d  ", chd->Samplenumber);
+    else
+      printf ("--  ");
+
+    if (chd->Effect != 0 || chd->EffectArg != 0)  // if effect number and effect argument are 0, no effect here
+      printf ("%1X%2.2X",chd->Effect, chd->EffectArg);
+    else
+      printf ("---");
+
+    if (ch != mod->Numchannels-1)
+      printf (" | ");
+    else
+      printf (" |\n");
+  }
+}
+
+// Function: prints on the standard out the info for a MOD loaded into the
+// mod structure.
+void InfoMOD (const TModule *mod)
+{
+  int i;
+
+  printf ("Module name              : %s\n", mod->Songname);
+  printf ("Module length            : %d patterns\n", mod->Songlength);
+  printf ("Number of unique patterns: %d\n", mod->Numpatterns);
+  printf ("Number of channels       : %d\n", mod->Numchannels);
+  printf ("Pattern sequence         : ");
+  for (i=0; i<mod->Songlength; i++)
+    printf ("%2.2d ", mod->Songpositions[i]);
+  puts("");
+
+  printf ("Samples:\n");
+  for (i=0; i<31; i++)
+  {
+    if (mod->sample[i].Samplename[0] != 0 || mod->sample[i].Samplelength !=0)
+    {
+      printf ("%-22.22s  V:%2d  L:%5d   R:%5d %5d  F:%+d\n",
+              mod->sample[i].Samplename,
+              mod->sample[i].Volume,
+              (int)mod->sample[i].Samplelength,
+              (int)mod->sample[i].Repeatpoint,
+              (int)mod->sample[i].Repeatlength,
+              (int)((mod->sample[i].Finetune<8)? mod->sample[i].Finetune : mod->sample[i].Finetune-16));
+    }
+  }
+
+  puts("");
+  /*for (i=0; i<mod->Numpatterns; i++)
+  {
+    int patrow;
+    for (patrow=0; patrow<64; patrow++)
+    {
+      PrintRow (mod, i, patrow);
+    }
+    puts("");
+  }*/
+}
+
+
+// Function: returns a pseudo random number from 0 to 32767. Each player
+// keeps its own seed, so players don't interfere with each other and the
+// output of a MOD is always the same, on whatever thread it is rendered.
+int ModRand (TModPlay *mp)
+{
+  mp->rndseed = mp->rndseed * 1103515245UL + 12345UL;
+  return (mp->rndseed >> 16) & 0x7FFF;
+}
+
+// Function: returns the table of phases for the phase-accum counter to play
+// every note period at sfreq Hz with the given format, building it if this
+// is the first time it's asked for. Returns NULL if there is no room for
+// another table, or the frequency is so low that phases don't fit in 32
+// bits. Tables are never freed. This is not thread safe when it has to
+// build a table, so whoever starts several players at once must call it
+// first (BatchRenderMOD() does).
+const uint32_t *GetPhaseTable (uint32_t sfreq, uint8_t format)
+{
+  uint32_t *phases;
+  int i;
+
+  for (i=0; i<nphasetables; i++)
+    if (phasetables[i].sfreq == sfreq && phasetables[i].format == format)
+      return phasetables[i].phases;
+
+  if (nphasetables == MAXPHASETABLES || sfreq < 1000)
+    return NULL;
+  phases = malloc (MAXPERIOD * sizeof phases[0]);
+  if (phases == NULL)
+    return NULL;
+  for (i=0; i<MAXPERIOD; i++)
+    phases[i] = (format==PAL)? PHASE(PALCLOCK, sfreq, i) : PHASE(NTSCCLOCK, sfreq, i);
+  phasetables[nphasetables].sfreq = sfreq;
+  phasetables[nphasetables].format = format;
+  phasetables[nphasetables].phases = phases;
+  nphasetables++;
+  return phases;
+}
+
+// Function: returns the phase for the phase-accum counter of a channel to
+// play a note with the given period. Remember that the phase-accum counter
+// has a 15 bit accum, so phase must be shifted 15 bits left, or multiplied
+// by 32768
+size_t PeriodToPhase (TModPlay *mp, uint16_t period)
+{
+  if (period < MAXPERIOD && mp->phases != NULL)
+    return mp->phases[period];
+  if (period == 0)
+    return 0;
+  return ((mp->format==PAL)? 32768LL * PALCLOCK : 32768LL * NTSCCLOCK) / (mp->sfreq * period);
+}
+
+// A series of small functions that implement each one of the effects
+// For each effect, a test is made to see if we are at tick 0 (beginning of a division)
+// or any other tick, as some effects do some initialization at tick 0, and perform the
+// actual effect in the following ticks.
+
+// Function: returns period * pot / 2^24, pot being one of the fixed point
+// factors used by DoArpeggio_00()
+uint16_t ArpeggioPeriod (uint16_t period, uint32_t pot)
+{
+  return (period * (pot >> 12) + ((period * (pot & 0xFFF)) >> 12)) >> 12;
+}
+
+void DoArpeggio_00 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
+{
+  // Scaled (fixed point) versions of this sequence: for i=0 to 15: pot[i] = 1 / 2^(i/12)
+  // Actually, pot[i] = 2^24 / 2^(i/12). Used to alter the pitch of a note in seminote intervals.
+  // Each one is split into its high and low 12 bits, so period * pot / 2^24
+  // can be done with 32 bit integers only:
+  // (period*pothi*2^12 + period*potlo) / 2^24 = (period*pothi + (period*potlo)/2^12) / 2^12
+  static const uint32_t pot[16] = {16777216,15835583,14946800,14107900,13316085,
+                             12568710,11863283,11197448,10568983,9975792,
+                             9415894,8887420,8388608,7917791,7473400,7053950};
+  uint16_t newperiod;
+
+  if (mp->tick != 0)
+  {
+    if (chd->EffectArg != 0)
     {
-      switch (mplay.tick % 3)
+      switch (mp->tick % 3)
       {
       case 0:
         newperiod = chan->noteperiod;
         break;
       case 1:
-        newperiod = chan->noteperiod * pot[chd->EffectArg & 0xF]/16777216LL;  // new period is calculated from power of two table.
+        newperiod = ArpeggioPeriod (chan->noteperiod, pot[chd->EffectArg & 0xF]);  // new period is calculated from power of two table.
         break;
       case 2:
-        newperiod = chan->noteperiod * pot[(chd->EffectArg>>4) & 0xF]/16777216LL;  // new period is calculated from power of two table.
+        newperiod = ArpeggioPeriod (chan->noteperiod, pot[(chd->EffectArg>>4) & 0xF]);  // new period is calculated from power of two table.
         break;
       default:
         newperiod = chan->noteperiod;
         break;
       }
-      chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * newperiod);  // and used to calculate new phase for phase-accum counter
+      chan->fase = PeriodToPhase (mp, newperiod);  // and used to calculate new phase for phase-accum counter
     }
   }
 }
 
-void DoSlideUp_01 (TChannelData *chd, TChanPlay *chan)
+void DoSlideUp_01 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
     chan->pslide = chd->EffectArg;
   else
   {
@@ -512,13 +1604,13 @@ void DoSlideUp_01 (TChannelData *chd, TChanPlay *chan)
       chan->noteperiod -= chan->pslide;  // apply portamento
     else
       chan->noteperiod  = finetune_table[chan->finetune][35];  // else stays at B-3
-    chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * chan->noteperiod);  // calculate new phase
+    chan->fase = PeriodToPhase (mp, chan->noteperiod);  // calculate new phase
   }
 }
 
-void DoSlideDown_02 (TChannelData *chd, TChanPlay *chan)
+void DoSlideDown_02 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
     chan->pslide = chd->EffectArg;
   else
   {
@@ -526,13 +1618,13 @@ void DoSlideDown_02 (TChannelData *chd, TChanPlay *chan)
       chan->noteperiod += chan->pslide;  // apply portamento
     else
       chan->noteperiod  = finetune_table[chan->finetune][0];  // else stays at C-1
-    chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * chan->noteperiod);  // calculate new phase
+    chan->fase = PeriodToPhase (mp, chan->noteperiod);  // calculate new phase
   }                                                    // remember that the phase-accum counter has a 15 bit accum, so phase must be shifted 15 bits left,                       
 }                                                      // or multiplied by 32768
 
-void DoSlideToNote_03 (TChannelData *chd, TChanPlay *chan)
+void DoSlideToNote_03 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (chd->Noteperiod != 0)
       chan->noteperiodslideto = finetune_table[chan->finetune][chd->NoteIndex];  // new target for Portamento
@@ -555,58 +1647,58 @@ void DoSlideToNote_03 (TChannelData *chd, TChanPlay *chan)
       else
         chan->noteperiod = chan->noteperiodslideto;
     }
-    chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * chan->noteperiod);
+    chan->fase = PeriodToPhase (mp, chan->noteperiod);
   }
 }
 
-void DoVibrato_04 (TChannelData *chd, TChanPlay *chan)
+void DoVibrato_04 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
   // Every oscillator waveform is 64 points long, and the speed parameter
   // denotes by how many points per tick the play position is advanced.
   // So at a vibrato speed of 2, the vibrato waveform repeats after 32 ticks.
   // The Random waveforms are not supported by ProTracker and FastTracker.
   // While they are supported by some MOD / XM players, they should be avoided.
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (((chd->EffectArg>>4) & 0xF) != 0)
       chan->vbspeed = (chd->EffectArg>>4) & 0xF;
     if ((chd->EffectArg & 0xF) != 0)
       chan->vbamp = chd->EffectArg & 0xF;
-    if (mplay.vbretrig == 1)
+    if (mp->vbretrig == 1)
       chan->vbpos = 0;
   }
   else
   {
-    uint16_t newperiod = chan->noteperiod + waveforms[mplay.vbwave][chan->vbpos] * chan->vbamp / 128L;
+    uint16_t newperiod = chan->noteperiod + waveforms[mp->vbwave][chan->vbpos] * chan->vbamp / 128L;
     chan->vbpos = (chan->vbpos + chan->vbspeed) & 0x3F;
-    chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * newperiod);  // and used to calculate new phase for phase-accum counter
+    chan->fase = PeriodToPhase (mp, newperiod);  // and used to calculate new phase for phase-accum counter
   }
 }
 
 // Tremolo is calculated much the same way as vibrato is.
-void DoTremolo_07 (TChannelData *chd, TChanPlay *chan)
+void DoTremolo_07 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (((chd->EffectArg>>4) & 0xF) != 0)
       chan->trspeed = (chd->EffectArg>>4) & 0xF;
     if ((chd->EffectArg & 0xF) != 0)
       chan->tramp = chd->EffectArg & 0xF;
-    if (mplay.trretrig == 1)
+    if (mp->trretrig == 1)
       chan->trpos = 0;
   }
   else
   {
-    int16_t newvol = chan->volbase + waveforms[mplay.trwave][chan->trpos] * chan->tramp / 64L;
+    int16_t newvol = chan->volbase + waveforms[mp->trwave][chan->trpos] * chan->tramp / 64L;
     newvol = (newvol<0)? 0 : (newvol>64)? 64 : newvol;
     chan->trpos = (chan->trpos + chan->trspeed) & 0x3F;
     chan->volume = newvol;
   }
 }
 
-void DoVolumeSlide_10 (TChannelData *chd, TChanPlay *chan)
+void DoVolumeSlide_10 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     chan->vslideup = (chd->EffectArg & 0xF0)>>4; // volume slide up, or down
     chan->vslidedown = (chd->EffectArg & 0xF);   // (only one of them must be non zero)
@@ -621,122 +1713,123 @@ void DoVolumeSlide_10 (TChannelData *chd, TChanPlay *chan)
   }
 }
 
-void DoSlideToNoteAndVolumeSlide_05 (TChannelData *chd, TChanPlay *chan)
+void DoSlideToNoteAndVolumeSlide_05 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)  // slide to tone effect here must not store the sliding value, as the effect argument here is volume sliding
+  if (mp->tick == 0)  // slide to tone effect here must not store the sliding value, as the effect argument here is volume sliding
   {
     if (chd->Noteperiod != 0)
       chan->noteperiodslideto = finetune_table[chan->finetune][chd->NoteIndex];  // new target for Portamento
   }
   else
-    DoSlideToNote_03 (chd, chan);
+    DoSlideToNote_03 (mp, chd, chan);
 
-  DoVolumeSlide_10 (chd, chan);
+  DoVolumeSlide_10 (mp, chd, chan);
 }
 
-void DoVibratoAndVolumeSlide_06 (TChannelData *chd, TChanPlay *chan)
+void DoVibratoAndVolumeSlide_06 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    if (mplay.vbretrig == 1)
+    if (mp->vbretrig == 1)
       chan->vbpos = 0;
   }
   else
-    DoVibrato_04 (chd, chan);
-  DoVolumeSlide_10 (chd, chan);
+    DoVibrato_04 (mp, chd, chan);
+  DoVolumeSlide_10 (mp, chd, chan);
 }
 
-void DoSampleOffset_09 (TChannelData *chd, TChanPlay *chan)
+void DoSampleOffset_09 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (chd->EffectArg != 0)         // sample offset. argument is high byte of new offset.
       chan->faseacum = (chd->EffectArg * 256)<<15; // Store it into the phase-accumulator counter
   }
 }
 
-void DoJumpSongposition_11 (TChannelData *chd, TChanPlay *chan)
+void DoJumpSongposition_11 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    mplay.newsongpos = chd->EffectArg;  // jump to new song position.
-    mplay.newpatrow = 0;                // we start from division 0
+    mp->newsongpos = chd->EffectArg;  // jump to new song position.
+    mp->newpatrow = 0;                // we start from division 0
   }
 }
 
-void DoVolume_12 (TChannelData *chd, TChanPlay *chan)
+void DoVolume_12 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    chan->volume = chd->EffectArg;      // new volume for this channel
+    chan->volume = (chd->EffectArg > 64)? 64 : chd->EffectArg;  // new volume for this channel. Above 64 it's 64, as in ProTracker
     chan->volbase = chan->volume;
   }
 }
 
-void DoPatternBreak_13 (TChannelData *chd, TChanPlay *chan)
+void DoPatternBreak_13 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    mplay.newsongpos = mplay.songpos + 1;  // pattern break. We jump to the next song position
-    mplay.newpatrow = ((chd->EffectArg >> 4)&0x0F)*10+(chd->EffectArg & 0xF);  // and a certain division, given in BCD!
+    mp->newsongpos = mp->songpos + 1;  // pattern break. We jump to the next song position
+    mp->newpatrow = ((chd->EffectArg >> 4)&0x0F)*10+(chd->EffectArg & 0xF);  // and a certain division, given in BCD!
   }
 }
 
-void DoFineSlideUp_14_01 (TChannelData *chd, TChanPlay *chan)
+void DoFineSlideUp_14_01 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    mplay.tick = 1;  // dirty trick to fool DoSlideUp_01() so it does the actual sliding
+    mp->tick = 1;  // dirty trick to fool DoSlideUp_01() so it does the actual sliding
     chan->pslide = chd->EffectArg & 0xF;
-    DoSlideUp_01 (chd, chan);
-    mplay.tick = 0;  // back to its true value
+    DoSlideUp_01 (mp, chd, chan);
+    mp->tick = 0;  // back to its true value
   }
 }
 
-void DoFineSlideDown_14_02 (TChannelData *chd, TChanPlay *chan)
+void DoFineSlideDown_14_02 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
-    mplay.tick = 1;  // dirty trick to fool DoSlideDown_02() so it does the actual sliding
+    mp->tick = 1;  // dirty trick to fool DoSlideDown_02() so it does the actual sliding
     chan->pslide = chd->EffectArg & 0xF;
-    DoSlideDown_02 (chd, chan);
-    mplay.tick = 0;  // back to its true value
+    DoSlideDown_02 (mp, chd, chan);
+    mp->tick = 0;  // back to its true value
   }
 }
 
-void DoSetVibratoWaveform_14_04 (TChannelData *chd, TChanPlay *chan)
+void DoSetVibratoWaveform_14_04 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  mplay.vbwave = chd->EffectArg & 0x3;
-  if (mplay.vbwave == 3)
-    mplay.vbwave = rand()%3;
-  mplay.vbretrig = (chd->EffectArg & 0x4)? 0 : 1;
+  mp->vbwave = chd->EffectArg & 0x3;
+  if (mp->vbwave == 3)
+    mp->vbwave = ModRand(mp)%3;
+  mp->vbretrig = (chd->EffectArg & 0x4)? 0 : 1;
 }
 
-void DoSetFinetune_14_05 (TChannelData *chd, TChanPlay *chan)
+void DoSetFinetune_14_05 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  chan->sample->Finetune = chd->EffectArg & 0xF;
+  if (chan->sample != NULL)  // the module is shared by other players, so the new finetune is kept in this player
+    mp->samplefinetune[chan->sample - mp->mod->sample] = chd->EffectArg & 0xF;
 }
 
-void DoSetTremoloWaveform_14_07 (TChannelData *chd, TChanPlay *chan)
+void DoSetTremoloWaveform_14_07 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  mplay.trwave = chd->EffectArg & 0x3;
-  if (mplay.trwave == 3)
-    mplay.trwave = rand()%3;
-  mplay.trretrig = (chd->EffectArg & 0x4)? 0 : 1;
+  mp->trwave = chd->EffectArg & 0x3;
+  if (mp->trwave == 3)
+    mp->trwave = ModRand(mp)%3;
+  mp->trretrig = (chd->EffectArg & 0x4)? 0 : 1;
 }
 
-void DoNoteRetrig_14_09 (TChannelData *chd, TChanPlay *chan)
+void DoNoteRetrig_14_09 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == (chd->EffectArg & 0x0F))
+  if (mp->tick == (chd->EffectArg & 0x0F))
   {
     chan->faseacum = 0;
     chan->position = 0;
   }
 }
 
-void DoFineVolumeSlideUp_14_10 (TChannelData *chd, TChanPlay *chan)
+void DoFineVolumeSlideUp_14_10 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (chan->volume + (chd->EffectArg & 0x0F) <= 64)
       chan->volume += (chd->EffectArg & 0x0F);
@@ -746,9 +1839,9 @@ void DoFineVolumeSlideUp_14_10 (TChannelData *chd, TChanPlay *chan)
   }
 }
 
-void DoFineVolumeSlideDown_14_11 (TChannelData *chd, TChanPlay *chan)
+void DoFineVolumeSlideDown_14_11 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (chan->volume - (chd->EffectArg & 0x0F) >= 0)
       chan->volume -= (chd->EffectArg & 0x0F);
@@ -758,20 +1851,20 @@ void DoFineVolumeSlideDown_14_11 (TChannelData *chd, TChanPlay *chan)
   }
 }
 
-void DoCutNote_14_12 (TChannelData *chd, TChanPlay *chan)
+void DoCutNote_14_12 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick > (chd->EffectArg & 0xF))
+  if (mp->tick > (chd->EffectArg & 0xF))
     chan->volume = 0;
 }
 
-void DoDelayNote_14_13 (TChannelData *chd, TChanPlay *chan)
+void DoDelayNote_14_13 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 1+(chd->EffectArg & 0xF))
+  if (mp->tick == 1+(chd->EffectArg & 0xF))
   {
     chan->volume = chan->volbase;
     chan->faseacum = 0;                         // init counters
     chan->position = 0;
-    chan->fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * chan->noteperiod);  // calculate phase for counter
+    chan->fase = PeriodToPhase (mp, chan->noteperiod);  // calculate phase for counter
   }
   else
   {
@@ -782,18 +1875,18 @@ void DoDelayNote_14_13 (TChannelData *chd, TChanPlay *chan)
   }
 }
 
-void DoSetSpeedBPM_15 (TChannelData *chd, TChanPlay *chan)
+void DoSetSpeedBPM_15 (TModPlay *mp, const TChannelData *chd, TChanPlay *chan)
 {
-  if (mplay.tick == 0)
+  if (mp->tick == 0)
   {
     if (chd->EffectArg<32)  // if it's under 32, the it's number of ticks per division.
     {
-      mplay.ticksperdiv = chd->EffectArg;
+      mp->ticksperdiv = chd->EffectArg;
     }
     else  // else, it's the number of bpm. A beat is 4 divisions
     {
-      mplay.bpm = chd->EffectArg;
-      mplay.tambufplay = (mplay.sfreq*15L)/(6*mplay.bpm);
+      mp->bpm = chd->EffectArg;
+      mp->tambufplay = (mp->sfreq*15L)/(6*mp->bpm);
       // for some reason (???), 6 ticks per division must be used for this
       // calculation, although the actual ticks per division rate may be
       // different
@@ -801,215 +1894,2743 @@ void DoSetSpeedBPM_15 (TChannelData *chd, TChanPlay *chan)
   }
 }
 
-// Function: process the effects for the current tick, in a given channel within a given division
-// within a given pattern (chd) and the information of that channel while being played (chan)
-void ProcessEffect (TChannelData *chd, TChanPlay *chan)
+// Type of the functions that do each effect
+typedef void (*TEffectFunc) (TModPlay *mp, const TChannelData *chd, TChanPlay *chan);
+
+// The function for each effect, as found by EffectIndex(): effects 0 to 15,
+// and then the miscellaneous ones (effect 14) by their number. NULL for the
+// ones that are not supported, which are never compiled into a command
+static const TEffectFunc effecthandlers[32] =
+{
+  DoArpeggio_00, DoSlideUp_01, DoSlideDown_02, DoSlideToNote_03,
+  DoVibrato_04, DoSlideToNoteAndVolumeSlide_05, DoVibratoAndVolumeSlide_06, DoTremolo_07,
+  NULL, DoSampleOffset_09, DoVolumeSlide_10, DoJumpSongposition_11,
+  DoVolume_12, DoPatternBreak_13, NULL, DoSetSpeedBPM_15,
+  NULL, DoFineSlideUp_14_01, DoFineSlideDown_14_02, NULL,
+  DoSetVibratoWaveform_14_04, DoSetFinetune_14_05, NULL, DoSetTremoloWaveform_14_07,
+  NULL, DoNoteRetrig_14_09, DoFineVolumeSlideUp_14_10, DoFineVolumeSlideDown_14_11,
+  DoCutNote_14_12, DoDelayNote_14_13, NULL, NULL
+};
+
+// Function: returns the sample at position j of an instrument being played
+// up to end, for interpolation filters that need samples beyond the ones
+// actually being played: past the end, they come from the loop, as the
+// mixer will play them, and before the start, they are silence
+int InterpTap (const TSample *s, size_t end, const int8_t *data, ptrdiff_t j)
 {
-  uint8_t SubEffect = (chd->EffectArg >> 4) & 0xF;
+  if (j < 0)
+    return 0;
+  if ((size_t)j < end)
+    return data[j];
+  if (s->Repeatlength == 0)
+    return 0;
+  return data[s->Repeatpoint + ((size_t)j - end) % s->Repeatlength];
+}
 
-  switch (chd->Effect)
+// Function: saturates an interpolated sample to 16 bits. Cubic and sinc
+// filters can overshoot a bit past the largest sample
+int Saturate16 (int v)
+{
+  return (v < -32768)? -32768 : (v > 32767)? 32767 : v;
+}
+
+// Function: returns the sample (x256) at position pos plus frac/32768 of an
+// instrument being played up to end, using the interpolation filter interp.
+// Every tap is checked, so this works anywhere in the instrument. The
+// kernels for each filter compute exactly the same, with no checks at all
+int InterpSample (const TSample *s, size_t end, const int8_t *data, size_t pos, unsigned frac, int interp)
+{
+  const int16_t *c;
+  int d0, suma, j;
+
+  d0 = data[pos];
+  switch (interp)
   {
-  case 0:  DoArpeggio_00                  (chd, chan); break;
-  case 1:  DoSlideUp_01                   (chd, chan); break;
-  case 2:  DoSlideDown_02                 (chd, chan); break;
-  case 3:  DoSlideToNote_03               (chd, chan); break;
-  case 4:  DoVibrato_04                   (chd, chan); break;
-  case 5:  DoSlideToNoteAndVolumeSlide_05 (chd, chan); break;
-  case 6:  DoVibratoAndVolumeSlide_06     (chd, chan); break;
-  case 7:  DoTremolo_07                   (chd, chan); break;
-  case 9:  DoSampleOffset_09              (chd, chan); break;
-  case 10: DoVolumeSlide_10               (chd, chan); break;
-  case 11: DoJumpSongposition_11          (chd, chan); break;
-  case 12: DoVolume_12                    (chd, chan); break;
-  case 13: DoPatternBreak_13              (chd, chan); break;
-  case 14:  // miscellaneous effects.
-    switch (SubEffect)
-    {
-    case 1:  DoFineSlideUp_14_01          (chd, chan); break;
-    case 2:  DoFineSlideDown_14_02        (chd, chan); break;
-    case 4:  DoSetVibratoWaveform_14_04   (chd, chan); break;
-    case 5:  DoSetFinetune_14_05          (chd, chan); break;
-    case 7:  DoSetTremoloWaveform_14_07   (chd, chan); break;
-    case 9:  DoNoteRetrig_14_09           (chd, chan); break;
-    case 10: DoFineVolumeSlideUp_14_10    (chd, chan); break;
-    case 11: DoFineVolumeSlideDown_14_11  (chd, chan); break;
-    case 12: DoCutNote_14_12              (chd, chan); break;
-    case 13: DoDelayNote_14_13            (chd, chan); break;
-    }
-    break;
-  case 15: DoSetSpeedBPM_15               (chd, chan); break;
+  case INTERP_LINEAR:
+    return (d0 * 32768 + (InterpTap (s, end, data, pos + 1) - d0) * (int)frac) >> 7;
+  case INTERP_CUBIC:
+    c = cubictable[frac >> 7];
+    suma = c[1] * d0;
+    for (j=-1; j<=2; j++)
+      if (j != 0)
+        suma += c[j+1] * InterpTap (s, end, data, (ptrdiff_t)pos + j);
+    return Saturate16 (suma >> 6);
+  case INTERP_SINC:
+    c = sinctable[frac >> 7];
+    suma = c[3] * d0;
+    for (j=-3; j<=4; j++)
+      if (j != 0)
+        suma += c[j+3] * InterpTap (s, end, data, (ptrdiff_t)pos + j);
+    return Saturate16 (suma >> 6);
   }
+  return d0 * 256;
 }
 
-// Function: does all the needed job to get a block of samples ready to be
-// played by the sound card in one tick.
-void PlayTick (void)
+// Function: the original mixer. For each output sample, it walks all the
+// channels, adding their contribution. It's kept as the reference that the
+// faster mixers must match sample by sample. It mixes n samples into mixl
+// (and mixr, for stereo output, where each channel is scaled by its gains
+// for the left and right side. For mono output, mixr is NULL). Samples are
+// read with the interpolation filter of the player, checking every tap.
+void MixChunkReference (TModPlay *mp, int32_t mixl[], int32_t mixr[], size_t n)
 {
-  static uint8_t sbuffer[44100];  // up to about 1 second of audio
-  int i, ch;
-  int muestra, mezcla;
-  uint8_t muestrafinal;
-
-  if (mplay.finished)  // if MOD has finished, do nothing.
-    return;
+  size_t i;
+  int ch;
+  int muestra, mezcla, mezclar;
 
-  if (mplay.tick >= mplay.ticksperdiv)  // if we have finished a division...
+  for (i=0; i<n; i++)  // repeat until the buffer is full
   {
-    mplay.tick = 0;   // beginning of a new division
-    if (mplay.newpatrow >= 0 || mplay.newsongpos >= 0)  // need to jump to another division or song position?
+    mezcla = 0;  // mix of all channels
+    mezclar = 0;
+    for (ch=0; ch<mp->numchannels; ch++)  // proceed with each of them
     {
-      if (mplay.newpatrow >= 0)  // do so for the new division
+      if (mp->chan[ch].sample == NULL || mp->chan[ch].sample->Sampledata == NULL)  // if instrument is silence, just don't add anything to the mix
+        continue;
+      if (mp->interp == INTERP_NEAREST)  // this is the current sample from the instrument (x256)
+        muestra = mp->chan[ch].sample->Sampledata[mp->chan[ch].position] * 256;
+      else
+        muestra = InterpSample (mp->chan[ch].sample, mp->chan[ch].end, mp->chan[ch].sample->Sampledata,
+                                mp->chan[ch].position, mp->chan[ch].faseacum & 0x7FFF, mp->interp);
+      mp->chan[ch].faseacum += mp->chan[ch].fase;           // now update offset to sample data for this instrument
+      mp->chan[ch].position = mp->chan[ch].faseacum >> 15;  // by using the result from the phase-accumulator counter
+      if (mp->chan[ch].position >= mp->chan[ch].end)        // check if we need to loop the instrument
       {
-        mplay.patrow = mplay.newpatrow;
-        mplay.newpatrow = -1;
+        mp->chan[ch].faseacum = (mp->chan[ch].sample->Repeatpoint << 15);    // go to the first repeat position
+        mp->chan[ch].position = mp->chan[ch].sample->Repeatpoint;
+        mp->chan[ch].end = mp->chan[ch].sample->Repeatpoint + mp->chan[ch].sample->Repeatlength;  // and mark the new instrument end as the end of repetition
       }
-      if (mplay.newsongpos >= 0)  // and the new song position
+      if (mixr == NULL)  // add the sample to the mix, after being scaled according to the current channel volume
+        mezcla += (muestra * mp->chan[ch].volume) >> 8;
+      else
       {
-        mplay.songpos = mplay.newsongpos;
-        mplay.newsongpos = -1;
+        mezcla += (muestra * (mp->chan[ch].volume * mp->gainl[ch])) >> 8;
+        mezclar += (muestra * (mp->chan[ch].volume * mp->gainr[ch])) >> 8;
       }
     }
-    else if (mplay.patrow >= 63)  // ran out of divisions in the current pattern?
-    {
-      mplay.patrow = 0;  // go to the beginning of...
-      mplay.songpos++;   // a new pattern
-    }
-    else
-      mplay.patrow++;  // else, just go to the next division in the current pattern
+    mixl[i] = mezcla;
+    if (mixr != NULL)
+      mixr[i] = mezclar;
+  }
+}
 
-    if (mplay.songpos >= mod.Songlength)  // ran out of patterns in the song?
-    {
-      mplay.finished = 1;  // then, signal it as finished
-      return;
-    }
+// Function: mixes a run of n samples from a sample into mix[]. The run has
+// been checked not to reach the end of the instrument, so there is no need
+// to look for a loop point in here. The first sample is taken from pos, and
+// the k-th one from (acc + k*fase) >> 15
+void MixRunScalar (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  size_t i;
+
+  for (i=0; i<n; i++)
+  {
+    mix[i] += data[pos] * vol;
+    acc += fase;
+    pos = acc >> 15;
   }
+}
 
-  if (mplay.tick == 0)
-    mplay.newrow = 1;  // signal the user program that a new division has started
+#ifdef MIXER_X86
+// Function: SSE2 version of MixRunScalar(). 4 samples are scaled and added
+// to the mix in one go.
+__attribute__((target("sse2")))
+void MixRunSSE2 (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  __m128i vvol, vmuestras, vmezcla;
+  size_t i;
 
-  for (ch=0; ch<4; ch++)  // now process each channel
+  vvol = _mm_set1_epi32 (vol & 0xFFFF);  // volume and samples go in the low half of each lane, so madd does a 16x16->32 product
+  for (i=0; i+4 <= n; i+=4)
   {
-    TChannelData *chd = &(mod.pattern[mod.Songpositions[mplay.songpos]].row[mplay.patrow].chan[ch]);
-    if (mplay.tick == 0)  // first tick in the division?
-    {
-      if (chd->Samplenumber != 0)  // retrieve sample data for current instrument, if given.
-      {
-        mplay.chan[ch].sample = &(mod.sample[chd->Samplenumber-1]);
-        mplay.chan[ch].finetune = mod.sample[chd->Samplenumber-1].Finetune;
-        mplay.chan[ch].end = mod.sample[chd->Samplenumber-1].Samplelength;
-        mplay.chan[ch].volume = mod.sample[chd->Samplenumber-1].Volume;
-        mplay.chan[ch].volbase = mplay.chan[ch].volume;
-      }
-      if (chd->Noteperiod != 0 && chd->Effect != 3 && chd->Effect != 5)  // calculate values for phase-accumulator counter from the current noteperiod.
-      {                                              // except if effect number is 3 or 5 (Portamento to note), because notepriod is then an argument to that effect
-        uint16_t ActualNotePeriod = finetune_table[mplay.chan[ch].finetune][chd->NoteIndex];
-        mplay.chan[ch].noteperiodslideto = ActualNotePeriod;  // this may be a new target for Portamento to note after all
-        mplay.chan[ch].noteperiod = ActualNotePeriod;
-        mplay.chan[ch].faseacum = 0;                         // init counters
-        mplay.chan[ch].position = 0;
-        mplay.chan[ch].fase = ((mplay.format==PAL)? 32768LL * 3546895LL : 32768LL * 3579545LL) / (mplay.sfreq * ActualNotePeriod);  // calculate phase for counter
-      }
-    }
-    ProcessEffect (chd, &mplay.chan[ch]);  // after processing the channel for tick 0, process any effect in the channel (all ticks)
+    vmuestras = _mm_set_epi32 ((uint16_t)data[(acc + 3*fase) >> 15],
+                               (uint16_t)data[(acc + 2*fase) >> 15],
+                               (uint16_t)data[(acc + fase) >> 15],
+                               (uint16_t)data[pos]);
+    vmezcla = _mm_loadu_si128 ((__m128i *)(mix + i));
+    vmezcla = _mm_add_epi32 (vmezcla, _mm_madd_epi16 (vmuestras, vvol));
+    _mm_storeu_si128 ((__m128i *)(mix + i), vmezcla);
+    acc += 4*fase;
+    pos = acc >> 15;
   }
+  MixRunScalar (data, acc, fase, pos, vol, mix + i, n - i);
+}
 
-  // all data for current tick has been updated. Now, using current instruments and current phase-accum values, retrieve and
-  // mix all the samples needed to fill the sound buffer for this tick.
-  for (i=0; i<mplay.tambufplay; i++)  // repeat until the buffer is full
+// Function: AVX2 version of MixRunScalar(), 8 samples at a time. Positions
+// for the 8 samples are computed in a vector register too, and samples are
+// fetched with a gather: a 32 bit word is read so that the wanted byte is
+// its top one, which then gets sign extended by an arithmetic shift. That
+// reads the 3 bytes before each sample, which are guard samples for the
+// first 3 bytes of the instrument. Everything fits in 32 bits, as the run
+// does not go past the end of the instrument, which is never longer than
+// MAXSAMPLELENGTH, not even with its loop unrolled.
+__attribute__((target("avx2")))
+void MixRunAVX2 (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  __m256i vvol, vfases, vpos, vmuestras, vmezcla;
+  size_t i = 0;
+
+  vvol = _mm256_set1_epi32 (vol);
+  vfases = _mm256_mullo_epi32 (_mm256_set1_epi32 ((uint32_t)fase), _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7));
+  for (; i+8 <= n; i+=8)
   {
-    mezcla = 0;  // mix of all channels
-    for (ch=0; ch<4; ch++)  // proceed with each of them
-    {
-      if (mplay.chan[ch].sample == NULL || mplay.chan[ch].sample->Sampledata == NULL)  // if instrument is silence, just don't add anything to the mix
-        continue;
-      muestra = mplay.chan[ch].sample->Sampledata[mplay.chan[ch].position] * mplay.chan[ch].volume;  // this is the current sample from the instrument, after being scaled according to the current channel volume
-      mplay.chan[ch].faseacum += mplay.chan[ch].fase;           // now update offset to sample data for this instrument
-      mplay.chan[ch].position = mplay.chan[ch].faseacum >> 15;  // by using the result from the phase-accumulator counter
-      if (mplay.chan[ch].position >= mplay.chan[ch].end)        // check if we need to loop the instrument
-      {
-        mplay.chan[ch].faseacum = (mplay.chan[ch].sample->Repeatpoint << 15);    // go to the first repeat position
-        mplay.chan[ch].position = mplay.chan[ch].sample->Repeatpoint;
-        mplay.chan[ch].end = mplay.chan[ch].sample->Repeatpoint + mplay.chan[ch].sample->Repeatlength;  // and mark the new instrument end as the end of repetition
-      }
-      mezcla += muestra;  // add the sample to the mix
-    }
-    muestrafinal = 128 + (mezcla / (4*64));  // average the final mix, and convert to an unsigned 8-bit value for sound card
-    sbuffer[i] = muestrafinal;
+    vpos = _mm256_srli_epi32 (_mm256_add_epi32 (_mm256_set1_epi32 ((uint32_t)acc), vfases), 15);
+    vpos = _mm256_blend_epi32 (vpos, _mm256_set1_epi32 ((uint32_t)pos), 1);  // first sample comes from the current position, which may not be acc>>15 (see DoSampleOffset_09)
+    vmuestras = _mm256_i32gather_epi32 ((const int *)(data - 3), vpos, 1);
+    vmuestras = _mm256_srai_epi32 (vmuestras, 24);
+    vmezcla = _mm256_loadu_si256 ((__m256i *)(mix + i));
+    vmezcla = _mm256_add_epi32 (vmezcla, _mm256_mullo_epi32 (vmuestras, vvol));
+    _mm256_storeu_si256 ((__m256i *)(mix + i), vmezcla);
+    acc += 8*fase;
+    pos = acc >> 15;
   }
-  ReproducirAudio (sbuffer, mplay.tambufplay);  // send the block to the audio device
+  MixRunScalar (data, acc, fase, pos, vol, mix + i, n - i);
+}
+#endif
+
+// Function: as MixRunScalar(), but interpolating linearly between the
+// sample at each position and the next one
+void MixRunLinearScalar (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  size_t i;
+  int d0, v;
 
-  mplay.tick++;
+  for (i=0; i<n; i++)
+  {
+    d0 = data[pos];
+    v = (d0 * 32768 + (data[pos+1] - d0) * (int)(acc & 0x7FFF)) >> 7;
+    mix[i] += (v * vol) >> 8;
+    acc += fase;
+    pos = acc >> 15;
+  }
 }
 
-int BeginPlayMOD (uint32_t sfreq)
+// Function: as MixRunScalar(), but with the 4 tap cubic filter
+void MixRunCubicScalar (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
 {
-  int ch, i;
+  const int8_t *p;
+  const int16_t *c;
+  size_t i;
+  int v;
 
-  memset (mplay.chan, 0, sizeof mplay.chan);  // init the mod.chan table
-  for (ch=0; ch<4; ch++)
+  for (i=0; i<n; i++)
   {
-    mplay.chan[ch].volume = 64;  // defaults to max volume for each channel (maybe not needed after all)
+    p = data + pos - 1;
+    c = cubictable[(acc & 0x7FFF) >> 7];
+    v = Saturate16 ((c[0]*p[0] + c[1]*p[1] + c[2]*p[2] + c[3]*p[3]) >> 6);
+    mix[i] += (v * vol) >> 8;
+    acc += fase;
+    pos = acc >> 15;
   }
-  // init MOD play defaults
-  mplay.sfreq = sfreq;
-  mplay.songpos = 0;
-  mplay.patrow = 0;
-  mplay.newsongpos = -1;
-  mplay.newpatrow = -1;
-  mplay.ticksperdiv = 6;
-  mplay.bpm = 125;
-  mplay.vbwave = 0;
-  mplay.vbretrig = 1;
-  mplay.trwave = 0;
-  mplay.trretrig = 1;
-  mplay.tambufplay = (sfreq*15L)/(mplay.ticksperdiv*mplay.bpm);  // 125 bpm, sfreq Hz, 6 ticks/div
-  mplay.finished = 0;
+}
 
-  // open audio device with a user callback function which will be executed
-  // each time an audio block has finished playing
-  if (AbrirAudioCallBack (mplay.sfreq, &PlayTick) != 0)
-    return 0;
+// Function: as MixRunScalar(), but with the 8 tap sinc filter
+void MixRunSincScalar (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  const int8_t *p;
+  const int16_t *c;
+  size_t i;
+  int v, suma, j;
 
-  // now all audio buffers are empty, so we fill all of them
-  for (i=0; i<MAXAUDIOBUFFERS; i++)
-    PlayTick();
-  return 1;
+  for (i=0; i<n; i++)
+  {
+    p = data + pos - 3;
+    c = sinctable[(acc & 0x7FFF) >> 7];
+    suma = 0;
+    for (j=0; j<8; j++)
+      suma += c[j] * p[j];
+    v = Saturate16 (suma >> 6);
+    mix[i] += (v * vol) >> 8;
+    acc += fase;
+    pos = acc >> 15;
+  }
 }
 
-// Function: finishes MOD audio playing.
-void EndPlayMOD (void)
+#ifdef MIXER_X86
+// Function: adds 4 interpolated samples (x256, already saturated to 16 bits)
+// scaled by vol to mix[], as the scalar kernels do: (v * vol) >> 8
+__attribute__((target("sse2")))
+static inline void MixInterpolatedSSE2 (__m128i vsumas, __m128i vvol, int32_t mix[])
 {
-  mplay.finished = 1;
-  CerrarAudio();
+  __m128i vmuestras, vmezcla;
+
+  vmuestras = _mm_packs_epi32 (vsumas, vsumas);  // saturate to 16 bits...
+  vmuestras = _mm_unpacklo_epi16 (vmuestras, _mm_setzero_si128());  // ...and leave them in the low half of each lane, ready for madd
+  vmezcla = _mm_loadu_si128 ((__m128i *)mix);
+  vmezcla = _mm_add_epi32 (vmezcla, _mm_srai_epi32 (_mm_madd_epi16 (vmuestras, vvol), 8));
+  _mm_storeu_si128 ((__m128i *)mix, vmezcla);
 }
 
-// main function. Retrieves MOD file name and optional sampling frequency
-// from user arguments, then load the MOD, display some info about it, and then,
-// it starts playing it (in background). Meanwhile, the main function continues
-// in a loop printing new pattern divisions as they are being played, while
-// waiting for the song to finish or the user to press the ESC key.
-int main (int argc, char *argv[])
+// Function: SSE2 version of MixRunLinearScalar(), 4 samples at a time
+__attribute__((target("sse2")))
+void MixRunLinearSSE2 (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
 {
-  int res, i, tecla;
-  char fname[256] = "";
-  uint32_t sfreq = 32000;  // minimum sampling frequency to play MODs without aliasing.
+  __m128i vvol, vd0, vd1, vfrac, vsumas;
+  size_t i, p1, p2, p3;
+
+  vvol = _mm_set1_epi32 (vol & 0xFFFF);
+  for (i=0; i+4 <= n; i+=4)
+  {
+    p1 = (acc + fase) >> 15;
+    p2 = (acc + 2*fase) >> 15;
+    p3 = (acc + 3*fase) >> 15;
+    vd0 = _mm_set_epi32 (data[p3], data[p2], data[p1], data[pos]);
+    vd1 = _mm_set_epi32 (data[p3+1], data[p2+1], data[p1+1], data[pos+1]);
+    vfrac = _mm_set_epi32 ((acc + 3*fase) & 0x7FFF, (acc + 2*fase) & 0x7FFF, (acc + fase) & 0x7FFF, acc & 0x7FFF);
+    // the difference between samples fits in the low half of each lane, and
+    // the fraction has its high half clear, so madd does the product
+    vsumas = _mm_add_epi32 (_mm_slli_epi32 (vd0, 15), _mm_madd_epi16 (_mm_sub_epi32 (vd1, vd0), vfrac));
+    MixInterpolatedSSE2 (_mm_srai_epi32 (vsumas, 7), vvol, mix + i);
+    acc += 4*fase;
+    pos = acc >> 15;
+  }
+  MixRunLinearScalar (data, acc, fase, pos, vol, mix + i, n - i);
+}
 
-  mplay.format = PAL;
+// Function: SSE2 version of MixRunCubicScalar(). The 4 taps of two samples
+// fill a register, so a madd does half of the filter for both of them
+__attribute__((target("sse2")))
+void MixRunCubicSSE2 (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  __m128i vvol, vbytes, vsigno, v01, v23, vsumas;
+  size_t i, a1, a2, a3;
+  int32_t t0, t1, t2, t3;
 
-  for (i=1; i<argc; i++)
+  vvol = _mm_set1_epi32 (vol & 0xFFFF);
+  for (i=0; i+4 <= n; i+=4)
   {
-    if (strlen(argv[i])>2 && argv[i][0]=='-')
+    a1 = acc + fase;
+    a2 = acc + 2*fase;
+    a3 = acc + 3*fase;
+    memcpy (&t0, data + pos - 1, 4);
+    memcpy (&t1, data + (a1 >> 15) - 1, 4);
+    memcpy (&t2, data + (a2 >> 15) - 1, 4);
+    memcpy (&t3, data + (a3 >> 15) - 1, 4);
+    vbytes = _mm_unpacklo_epi64 (_mm_unpacklo_epi32 (_mm_cvtsi32_si128 (t0), _mm_cvtsi32_si128 (t1)),
+                                 _mm_unpacklo_epi32 (_mm_cvtsi32_si128 (t2), _mm_cvtsi32_si128 (t3)));
+    vsigno = _mm_cmpgt_epi8 (_mm_setzero_si128(), vbytes);
+    v01 = _mm_madd_epi16 (_mm_unpacklo_epi8 (vbytes, vsigno),
+                          _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i *)cubictable[(acc & 0x7FFF) >> 7]),
+                                              _mm_loadl_epi64 ((const __m128i *)cubictable[(a1 & 0x7FFF) >> 7])));
+    v23 = _mm_madd_epi16 (_mm_unpackhi_epi8 (vbytes, vsigno),
+                          _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i *)cubictable[(a2 & 0x7FFF) >> 7]),
+                                              _mm_loadl_epi64 ((const __m128i *)cubictable[(a3 & 0x7FFF) >> 7])));
+    v01 = _mm_shuffle_epi32 (v01, _MM_SHUFFLE (3, 1, 2, 0));
+    v23 = _mm_shuffle_epi32 (v23, _MM_SHUFFLE (3, 1, 2, 0));
+    vsumas = _mm_add_epi32 (_mm_unpacklo_epi64 (v01, v23), _mm_unpackhi_epi64 (v01, v23));
+    MixInterpolatedSSE2 (_mm_srai_epi32 (vsumas, 6), vvol, mix + i);
+    acc += 4*fase;
+    pos = acc >> 15;
+  }
+  MixRunCubicScalar (data, acc, fase, pos, vol, mix + i, n - i);
+}
+
+// Function: SSE2 version of MixRunSincScalar(). The 8 taps of a sample fill
+// a register, and the partial sums of 4 samples are transposed and added
+__attribute__((target("sse2")))
+void MixRunSincSSE2 (const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  __m128i vvol, vbytes, vsigno, v[4], v01, v23, vsumas;
+  size_t i, k, p;
+
+  vvol = _mm_set1_epi32 (vol & 0xFFFF);
+  for (i=0; i+4 <= n; i+=4)
+  {
+    for (k=0; k<4; k+=2)
     {
-      switch (argv[i][1])
+      p = (k == 0)? pos : (acc + k*fase) >> 15;
+      vbytes = _mm_loadl_epi64 ((const __m128i *)(data + p - 3));
+      p = (acc + (k+1)*fase) >> 15;
+      vbytes = _mm_unpacklo_epi64 (vbytes, _mm_loadl_epi64 ((const __m128i *)(data + p - 3)));
+      vsigno = _mm_cmpgt_epi8 (_mm_setzero_si128(), vbytes);
+      v[k] = _mm_madd_epi16 (_mm_unpacklo_epi8 (vbytes, vsigno), _mm_loadu_si128 ((const __m128i *)sinctable[((acc + k*fase) & 0x7FFF) >> 7]));
+      v[k+1] = _mm_madd_epi16 (_mm_unpackhi_epi8 (vbytes, vsigno), _mm_loadu_si128 ((const __m128i *)sinctable[((acc + (k+1)*fase) & 0x7FFF) >> 7]));
+    }
+    v01 = _mm_add_epi32 (_mm_unpacklo_epi32 (v[0], v[1]), _mm_unpackhi_epi32 (v[0], v[1]));
+    v23 = _mm_add_epi32 (_mm_unpacklo_epi32 (v[2], v[3]), _mm_unpackhi_epi32 (v[2], v[3]));
+    vsumas = _mm_add_epi32 (_mm_unpacklo_epi64 (v01, v23), _mm_unpackhi_epi64 (v01, v23));
+    MixInterpolatedSSE2 (_mm_srai_epi32 (vsumas, 6), vvol, mix + i);
+    acc += 4*fase;
+    pos = acc >> 15;
+  }
+  MixRunSincScalar (data, acc, fase, pos, vol, mix + i, n - i);
+}
+#endif
+
+// Function: mixes a run of n samples from the instrument s, being played up
+// to end, as mixrun does, for any interpolation filter. Taps before the
+// start of the instrument, and past the end of the sample, read its guard
+// samples, so only a loop that ends before the sample does needs any care:
+// samples whose filter taps all fall inside the loop go to mixrun in one
+// go, and the few near its end are done one by one with InterpSample()
+void MixRunInterp (const TSample *s, size_t end, int interp, TMixFunc mixrun, const int8_t *data, size_t acc, size_t fase, size_t pos, int vol, int32_t mix[], size_t n)
+{
+  size_t after = (end == s->Samplelength)? 0 : interpafter[interp];  // past the end of the sample, taps read the guard samples
+  size_t i, m, limit;
+
+  if (interp == INTERP_NEAREST || after == 0)  // no taps outside of the instrument and its guard samples
+  {
+    mixrun (data, acc, fase, pos, vol, mix, n);
+    return;
+  }
+  limit = (end > after)? (end - after) << 15 : 0;  // samples before this have all their taps inside
+  i = 0;
+  while (i < n)
+  {
+    if (pos + after < end)
+    {
+      // the first sample is fine. See how many of the next ones are
+      if (acc >= limit)
+        m = 1;
+      else if (fase == 0)
+        m = n - i;
+      else
+        m = (limit - acc - 1) / fase + 1;
+      if (m > n - i)
+        m = n - i;
+      mixrun (data, acc, fase, pos, vol, mix + i, m);
+      i += m;
+      acc += m * fase;
+    }
+    else
+    {
+      mix[i++] += (InterpSample (s, end, data, pos, acc & 0x7FFF, interp) * vol) >> 8;
+      acc += fase;
+    }
+    pos = acc >> 15;
+  }
+}
+
+// Function: mixes n samples from a channel into mixl[], and mixr[] if it's
+// not NULL, scaled by the gain for each side, updating the channel state.
+// The block is split into runs that end where the instrument must loop.
+// Each run is handed to mixrun (through MixRunInterp(), which takes care of
+// the samples an interpolation filter needs from outside of the
+// instrument), and the loop is done between runs. Channels at volume 0 (or a side with gain 0) just
+// have their phase moved forward, run by run, so they don't cost a thing
+// per sample.
+void MixChannel (TChanPlay *chan, int32_t mixl[], int gainl, int32_t mixr[], int gainr, size_t n, TMixFunc mixrun, int interp)
+{
+  const int8_t *data = chan->sample->Sampledata;
+  size_t acc = chan->faseacum;
+  size_t fase = chan->fase;
+  size_t pos = chan->position;
+  size_t end = chan->end;
+  int voll = chan->volume * gainl;
+  int volr = (mixr != NULL)? chan->volume * gainr : 0;
+  size_t run, limit, done = 0;
+
+  while (n > 0)
+  {
+    // samples that can be output before the phase-accum counter reaches the
+    // end of the instrument. The last one of them is the one that loops.
+    limit = end << 15;
+    if (acc >= limit)  // past the end already (as after a 9xx too far), even with no period
+      run = 1;
+    else if (fase == 0)
+      run = n + 1;
+    else
+      run = (limit - acc - 1) / fase + 1;
+    if (run > n)  // the whole block can be done without looping
+    {
+      if (voll != 0)
+        MixRunInterp (chan->sample, end, interp, mixrun, data, acc, fase, pos, voll, mixl + done, n);
+      if (volr != 0)
+        MixRunInterp (chan->sample, end, interp, mixrun, data, acc, fase, pos, volr, mixr + done, n);
+      acc += n * fase;
+      pos = (n == 0 || fase == 0)? pos : acc >> 15;
+      break;
+    }
+    if (voll != 0)
+      MixRunInterp (chan->sample, end, interp, mixrun, data, acc, fase, pos, voll, mixl + done, run);
+    if (volr != 0)
+      MixRunInterp (chan->sample, end, interp, mixrun, data, acc, fase, pos, volr, mixr + done, run);
+    done += run;
+    n -= run;
+    acc = chan->sample->Repeatpoint << 15;  // go to the first repeat position
+    pos = chan->sample->Repeatpoint;
+    end = chan->sample->Repeatpoint + chan->sample->Repeatlength;  // and mark the new instrument end as the end of repetition
+  }
+  chan->faseacum = acc;
+  chan->position = pos;
+  chan->end = end;
+}
+
+// Function: returns 1 if the given mixer can run on this CPU
+int MixerAvailable (int mixer)
+{
+  switch (mixer)
+  {
+  case MIXER_REFERENCE:
+  case MIXER_SCALAR:
+    return 1;
+#ifdef MIXER_X86
+  case MIXER_SSE2:
+    return __builtin_cpu_supports ("sse2");
+  case MIXER_AVX2:
+    return __builtin_cpu_supports ("avx2");
+#endif
+  }
+  return 0;
+}
+
+// Function: returns the fastest mixer this CPU can run
+int BestMixer (void)
+{
+  int mixer;
+
+  for (mixer = MIXER_AUTO-1; mixer > MIXER_SCALAR; mixer--)
+    if (MixerAvailable (mixer))
+      break;
+  return mixer;
+}
+
+// Function: converts n stereo samples from the mix bus to interleaved 16
+// bit signed samples, scaled by scale, truncated and saturated.
+void ConvertS16Scalar (const int32_t mixl[], const int32_t mixr[], int16_t out[], size_t n, float scale)
+{
+  int32_t l, r;
+  size_t i;
+
+  for (i=0; i<n; i++)
+  {
+    l = (int32_t)(mixl[i] * scale);
+    r = (int32_t)(mixr[i] * scale);
+    out[2*i]   = (l < -32768)? -32768 : (l > 32767)? 32767 : l;
+    out[2*i+1] = (r < -32768)? -32768 : (r > 32767)? 32767 : r;
+  }
+}
+
+// Function: converts n stereo samples from the mix bus to interleaved 32
+// bit floating point samples, scaled by scale.
+void ConvertF32Scalar (const int32_t mixl[], const int32_t mixr[], float out[], size_t n, float scale)
+{
+  size_t i;
+
+  for (i=0; i<n; i++)
+  {
+    out[2*i]   = mixl[i] * scale;
+    out[2*i+1] = mixr[i] * scale;
+  }
+}
+
+#ifdef MIXER_X86
+// Function: SSE2 version of ConvertS16Scalar(). Same results: conversion
+// truncates, and packing saturates.
+__attribute__((target("sse2")))
+void ConvertS16SSE2 (const int32_t mixl[], const int32_t mixr[], int16_t out[], size_t n, float scale)
+{
+  __m128 vscale = _mm_set1_ps (scale);
+  __m128i vl, vr;
+  size_t i;
+
+  for (i=0; i+4 <= n; i+=4)
+  {
+    vl = _mm_cvttps_epi32 (_mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *)(mixl + i))), vscale));
+    vr = _mm_cvttps_epi32 (_mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *)(mixr + i))), vscale));
+    _mm_storeu_si128 ((__m128i *)(out + 2*i), _mm_packs_epi32 (_mm_unpacklo_epi32 (vl, vr), _mm_unpackhi_epi32 (vl, vr)));
+  }
+  ConvertS16Scalar (mixl + i, mixr + i, out + 2*i, n - i, scale);
+}
+
+// Function: SSE2 version of ConvertF32Scalar()
+__attribute__((target("sse2")))
+void ConvertF32SSE2 (const int32_t mixl[], const int32_t mixr[], float out[], size_t n, float scale)
+{
+  __m128 vscale = _mm_set1_ps (scale);
+  __m128 vl, vr;
+  size_t i;
+
+  for (i=0; i+4 <= n; i+=4)
+  {
+    vl = _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *)(mixl + i))), vscale);
+    vr = _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *)(mixr + i))), vscale);
+    _mm_storeu_ps (out + 2*i, _mm_unpacklo_ps (vl, vr));
+    _mm_storeu_ps (out + 2*i + 4, _mm_unpackhi_ps (vl, vr));
+  }
+  ConvertF32Scalar (mixl + i, mixr + i, out + 2*i, n - i, scale);
+}
+#endif
+
+// Function: converts n samples from the mix bus to the output format of the
+// player, storing them in out. This is the only place where the full
+// precision mix is scaled down.
+// For 8 bit mono, up to 4 channels, the mix is averaged as if there were 4
+// of them. With more channels, the gain goes down with the square root of
+// the number of channels, as the loudness of a mix of unrelated sounds
+// does, and the few peaks that don't fit are clipped.
+// For stereo, each side gets the same gain that 8 bit mono has (see
+// mp->outscale), so 16 bit output is the 8 bit one with 8 more bits.
+void ConvertMix (TModPlay *mp, const int32_t mixl[], const int32_t mixr[], uint8_t out[], size_t n)
+{
+  int32_t gain, v;
+  size_t i;
+
+  switch (mp->output)
+  {
+  case OUTPUT_S16STEREO:
+#ifdef MIXER_X86
+    if (mp->mixer >= MIXER_SSE2)
+    {
+      ConvertS16SSE2 (mixl, mixr, (int16_t *)out, n, mp->outscale);
+      break;
+    }
+#endif
+    ConvertS16Scalar (mixl, mixr, (int16_t *)out, n, mp->outscale);
+    break;
+
+  case OUTPUT_F32STEREO:
+#ifdef MIXER_X86
+    if (mp->mixer >= MIXER_SSE2)
+    {
+      ConvertF32SSE2 (mixl, mixr, (float *)out, n, mp->outscale);
+      break;
+    }
+#endif
+    ConvertF32Scalar (mixl, mixr, (float *)out, n, mp->outscale);
+    break;
+
+  default:
+    if (mp->numchannels <= 4)
+    {
+      for (i=0; i<n; i++)
+        out[i] = 128 + (mixl[i] / (4*64));  // average the final mix, and convert to an unsigned 8-bit value for sound card
+    }
+    else
+    {
+      gain = mixgains[mp->numchannels];
+      for (i=0; i<n; i++)
+      {
+        v = (mixl[i] * gain) >> 16;
+        out[i] = 128 + ((v < -128)? -128 : (v > 127)? 127 : v);
+      }
+    }
+    break;
+  }
+}
+
+// Function: moves a channel n samples forward, exactly as mixing them with
+// MixChannel() would, but without looking at a single sample. Once the
+// instrument has looped, every time around the loop takes the same number
+// of samples, so the whole thing takes the same time for any n.
+void AdvanceChannel (TChanPlay *chan, size_t n)
+{
+  size_t acc = chan->faseacum;
+  size_t fase = chan->fase;
+  size_t limit, run;
+
+  if (n == 0)
+    return;
+  limit = chan->end << 15;
+  if (fase == 0 && acc < limit)  // it doesn't move, and won't loop
+    return;
+  run = (acc >= limit)? 1 : (limit - acc - 1) / fase + 1;  // as in MixChannel()
+  if (run > n)
+    acc += n * fase;
+  else
+  {
+    n -= run;
+    acc = chan->sample->Repeatpoint << 15;
+    chan->end = chan->sample->Repeatpoint + chan->sample->Repeatlength;
+    limit = chan->end << 15;
+    if (fase > 0)  // with no period, it stays at the start of the loop
+    {
+      run = (acc >= limit)? 1 : (limit - acc - 1) / fase + 1;  // samples for each time around the loop
+      acc += (n % run) * fase;
+    }
+  }
+  chan->faseacum = acc;
+  chan->position = acc >> 15;
+}
+
+// Function: returns 1 if a channel adds anything to a mix with the given
+// gains. At volume 0, or once its instrument has finished and goes around
+// a loop of silence (as instruments that don't loop do), it adds nothing
+// at all until its next note, so it's moved forward with AdvanceChannel()
+// instead of being mixed.
+int ChannelAudible (const TChanPlay *chan, int gainl, int gainr)
+{
+  const TSample *s = chan->sample;
+
+  if (chan->volume == 0 || (gainl == 0 && gainr == 0))
+    return 0;
+  return !(s->Loopsilent && chan->position >= s->Repeatpoint && chan->end == s->Repeatpoint + s->Repeatlength);
+}
+
+// Function: mixes the next n samples of this tick into sbuffer, in chunks of
+// MIXCHUNK samples. Each chunk is mixed at full precision into a 32 bit mix bus (one
+// for each side, for stereo output), using the mixer selected for this
+// player, and then converted to the output format in a single pass.
+void MixFrames (TModPlay *mp, uint8_t sbuffer[], size_t n)
+{
+  int32_t mixl[MIXCHUNK], mixr[MIXCHUNK];
+  int32_t *pmixr;
+  TMixFunc mixrun;
+  size_t done, l, lframe;
+  int ch;
+
+  static const TMixFunc mixrunscalar[NUMINTERPS] = {MixRunScalar, MixRunLinearScalar, MixRunCubicScalar, MixRunSincScalar};
+#ifdef MIXER_X86
+  static const TMixFunc mixrunsse2[NUMINTERPS] = {MixRunSSE2, MixRunLinearSSE2, MixRunCubicSSE2, MixRunSincSSE2};
+#endif
+
+  mixrun = mixrunscalar[mp->interp];
+#ifdef MIXER_X86
+  if (mp->mixer == MIXER_AVX2 && mp->interp == INTERP_NEAREST)
+    mixrun = MixRunAVX2;
+  else if (mp->mixer >= MIXER_SSE2)  // interpolation filters use the SSE2 kernels on AVX2 too
+    mixrun = mixrunsse2[mp->interp];
+#endif
+  pmixr = (mp->output == OUTPUT_U8MONO)? NULL : mixr;
+  lframe = OutputFrameSize (mp->output);
+
+  for (done = 0; done < n; done += l)
+  {
+    l = n - done;
+    if (l > MIXCHUNK)
+      l = MIXCHUNK;
+    memset (mixl, 0, l * sizeof mixl[0]);
+    if (pmixr != NULL)
+      memset (mixr, 0, l * sizeof mixr[0]);
+    if (mp->mixer == MIXER_REFERENCE)
+      MixChunkReference (mp, mixl, pmixr, l);
+    else
+    {
+      for (ch=0; ch<mp->numchannels; ch++)
+      {
+        if (mp->chan[ch].sample == NULL || mp->chan[ch].sample->Sampledata == NULL)  // if instrument is silence, just don't add anything to the mix
+          continue;
+        if (!ChannelAudible (&mp->chan[ch], (pmixr == NULL)? 1 : mp->gainl[ch], (pmixr == NULL)? 0 : mp->gainr[ch]))
+          AdvanceChannel (&mp->chan[ch], l);
+        else if (pmixr == NULL)
+          MixChannel (&mp->chan[ch], mixl, 1, NULL, 0, l, mixrun, mp->interp);
+        else
+          MixChannel (&mp->chan[ch], mixl, mp->gainl[ch], mixr, mp->gainr[ch], l, mixrun, mp->interp);
+      }
+    }
+    ConvertMix (mp, mixl, pmixr, sbuffer + done*lframe, l);
+  }
+}
+
+// Function: runs the sequencer for one tick: moves to the next division if
+// needed, and processes notes and effects for each channel. Returns how
+// many samples this tick lasts, which is 0 if the MOD has finished.
+size_t SequenceTick (TModPlay *mp)
+{
+  const TCommand *c, *first, *last;
+  size_t row;
+
+  if (mp->finished)  // if MOD has finished, do nothing.
+    return 0;
+
+  if (mp->tick >= mp->ticksperdiv)  // if we have finished a division...
+  {
+    mp->tick = 0;   // beginning of a new division
+    if (mp->newpatrow >= 0 || mp->newsongpos >= 0)  // need to jump to another division or song position?
+    {
+      if (mp->newpatrow >= 0)  // do so for the new division
+      {
+        mp->patrow = mp->newpatrow;
+        mp->newpatrow = -1;
+      }
+      if (mp->newsongpos >= 0)  // and the new song position
+      {
+        mp->songpos = mp->newsongpos;
+        mp->newsongpos = -1;
+      }
+    }
+    else if (mp->patrow >= 63)  // ran out of divisions in the current pattern?
+    {
+      mp->patrow = 0;  // go to the beginning of...
+      mp->songpos++;   // a new pattern
+    }
+    else
+      mp->patrow++;  // else, just go to the next division in the current pattern
+
+    if (mp->songpos >= mp->mod->Songlength)  // ran out of patterns in the song?
+    {
+      mp->finished = 1;  // then, signal it as finished
+      return 0;
+    }
+  }
+
+  if (mp->tick == 0)
+    mp->newrow = 1;  // signal the user program that a new division has started
+
+  // now do what the compiled pattern says for this tick (see
+  // CompilePatterns()), channel by channel. A pattern break can go to a
+  // division past 63, which is then taken from the next pattern. After the
+  // last pattern, there is nothing
+  row = (size_t)mp->mod->Songpositions[mp->songpos]*64 + mp->patrow;
+  if (row < (size_t)mp->mod->Numpatterns*64)
+  {
+    first = mp->mod->commands + mp->mod->rowcommands[row*2 + (mp->tick != 0)];
+    last = mp->mod->commands + mp->mod->rowcommands[row*2 + (mp->tick != 0) + 1];
+  }
+  else
+    first = last = NULL;
+  for (c = first; c < last; c++)
+  {
+    const TChannelData *chd = &c->chd;
+    TChanPlay *chan = &mp->chan[c->ch];
+
+    if (c->flags & CMD_SAMPLE)  // retrieve sample data for current instrument, if given.
+    {
+      if (chd->Samplenumber > mp->samplesready)  // this only happens while a MOD is being loaded with LoadMODProgressive()
+        mp->samplesready = WaitSample (mp->mod, chd->Samplenumber-1);
+      chan->sample = &(mp->mod->sample[chd->Samplenumber-1]);
+      chan->finetune = mp->samplefinetune[chd->Samplenumber-1];
+      chan->end = mp->mod->sample[chd->Samplenumber-1].Samplelength;
+      chan->volume = mp->mod->sample[chd->Samplenumber-1].Volume;
+      chan->volbase = chan->volume;
+      if (chan->position >= chan->end)  // if the new instrument is shorter than where we are in the old one,
+      {                                 // go straight to its repeat section, as the mixer would do anyway
+        chan->faseacum = (chan->sample->Repeatpoint << 15);
+        chan->position = chan->sample->Repeatpoint;
+        chan->end = chan->sample->Repeatpoint + chan->sample->Repeatlength;
+      }
+    }
+    if (c->flags & CMD_NOTE)  // calculate values for phase-accumulator counter from the current noteperiod.
+    {
+      uint16_t ActualNotePeriod = finetune_table[chan->finetune][chd->NoteIndex];
+      chan->noteperiodslideto = ActualNotePeriod;  // this may be a new target for Portamento to note after all
+      chan->noteperiod = ActualNotePeriod;
+      chan->faseacum = 0;                         // init counters
+      chan->position = 0;
+      chan->fase = PeriodToPhase (mp, ActualNotePeriod);  // calculate phase for counter
+    }
+    if (c->effect != NOEFFECT)  // after processing the channel for tick 0, process its effect
+      effecthandlers[c->effect] (mp, chd, chan);
+  }
+
+  mp->tick++;
+  mp->frames += mp->tambufplay;
+  return mp->tambufplay;
+}
+
+// Function: adds a time of ns nanoseconds to the statistics of a stage
+static void StageStatsAdd (TStageStats *st, uint32_t ns)
+{
+  int b;
+
+  for (b=0; b<STATBUCKETS-1 && (ns >> (b+1)) != 0; b++)
+    ;
+  st->hist[b]++;
+  st->count++;
+  st->totalns += ns;
+  if (ns > st->maxns)
+    st->maxns = ns;
+}
+
+// Function: returns how many nanoseconds have gone by since start (a
+// TimerNow() timestamp)
+static uint32_t ElapsedNs (double start)
+{
+  double ns = (TimerNow() - start) * 1e9;
+
+  return (ns < 4e9)? (uint32_t)ns : 0xFFFFFFFFUL;
+}
+
+// Function: a tick of frames samples has just been rendered in ns
+// nanoseconds. Keeps track of the CPU load, and of ticks that took longer to
+// render than they last.
+static void TickStatsAdd (TPlayStats *st, uint32_t sfreq, size_t frames, uint64_t ns)
+{
+  uint64_t audions = (uint64_t)frames * 1000000000 / sfreq;
+  uint32_t load;
+
+  if (audions == 0)
+    return;
+  load = (uint32_t)(ns * 1000 / audions);
+  st->ticks++;
+  st->renderns += ns;
+  st->audions += audions;
+  st->loadhist[(load/100 < LOADBUCKETS-1)? load/100 : LOADBUCKETS-1]++;
+  if (load > 1000)
+    st->lateticks++;
+  if (load > st->peakload)
+    st->peakload = load;
+}
+
+// Function: does all the needed job to get a block of samples for one tick
+// ready to be played, and stores them into sbuffer (it must have room for
+// mp->tambufplay samples). Returns how many samples were generated, which
+// is 0 if the MOD has finished.
+size_t RenderTick (TModPlay *mp, uint8_t sbuffer[])
+{
+  size_t n;
+
+  n = SequenceTick (mp);
+  // all data for current tick has been updated. Now, using current instruments and current phase-accum values, retrieve and
+  // mix all the samples needed to fill the sound buffer for this tick.
+  if (n > 0)
+    MixFrames (mp, sbuffer, n);
+  return n;
+}
+
+// Function: the pull interface. Renders the next frames sample frames of
+// the song into out, a buffer owned by the caller with room for them in the
+// output format. Ticks are split wherever the block ends, and the rest of
+// the tick goes into the next call, so blocks of any size can be asked for,
+// and the output is the same as with RenderTick(). Nothing is
+// allocated, so this can be called from a realtime audio thread. Returns
+// how many frames were rendered, which is less than frames only if the song
+// has finished.
+size_t RenderFrames (TModPlay *mp, uint8_t out[], size_t frames)
+{
+  size_t done, n, lframe = OutputFrameSize (mp->output);
+  TPlayStats *st = mp->stats;
+  double t;
+  uint32_t ns;
+
+  if (st)
+    AtomicAdd (&st->seqrender, 1);
+  for (done = 0; done < frames; done += n)
+  {
+    if (mp->tickleft == 0)
+    {
+      if (st)
+        t = TimerNow();
+      mp->tickleft = SequenceTick (mp);
+      if (st)
+      {
+        ns = ElapsedNs (t);
+        StageStatsAdd (&st->stage[STAGE_SEQUENCER], ns);
+        st->tickns = ns;
+        st->tickframes = mp->tickleft;
+      }
+      if (mp->tickleft == 0)  // finished
+        break;
+    }
+    n = frames - done;
+    if (n > mp->tickleft)
+      n = mp->tickleft;
+    if (st)
+      t = TimerNow();
+    MixFrames (mp, out + done*lframe, n);
+    mp->tickleft -= n;
+    if (st)
+    {
+      ns = ElapsedNs (t);
+      StageStatsAdd (&st->stage[STAGE_MIX], ns);
+      st->tickns += ns;
+      if (mp->tickleft == 0)
+        TickStatsAdd (st, mp->sfreq, st->tickframes, st->tickns);
+    }
+  }
+  if (st)
+    AtomicAdd (&st->seqrender, 1);
+  return done;
+}
+
+// Function: as RenderTick(), but no audio is generated: channels are just
+// moved forward to where they would be after mixing this tick.
+size_t SkipTick (TModPlay *mp)
+{
+  size_t n;
+  int ch;
+
+  n = SequenceTick (mp);
+  for (ch=0; ch<mp->numchannels; ch++)
+    if (mp->chan[ch].sample != NULL && mp->chan[ch].sample->Sampledata != NULL)  // the mixer doesn't move silent channels either
+      AdvanceChannel (&mp->chan[ch], n);
+  return n;
+}
+
+// Function: fills opt with the default options to play a MOD
+void DefaultPlayOptions (TPlayOptions *opt)
+{
+  opt->sfreq = 32000;  // minimum sampling frequency to play MODs without aliasing.
+  opt->format = PAL;
+  opt->mixer = MIXER_AUTO;
+  opt->output = OUTPUT_U8MONO;
+  opt->separation = 100;
+  opt->interp = INTERP_NEAREST;
+  opt->startorder = 0;
+  opt->startrow = 0;
+  opt->startms = 0;
+  opt->highwaterms = 100;
+  opt->stats = NULL;
+}
+
+// Function: sets the player context mp to the beginning of the song in mod,
+// with the default tempo, ready to generate audio as told by opt.
+void InitPlayMOD (TModPlay *mp, const TModule *mod, TPlayOptions *opt)
+{
+  uint32_t sfreq = opt->sfreq;
+  int ch, i, own;
+
+  memset (mp, 0, sizeof *mp);  // init the mod.chan table and everything else
+  for (ch=0; ch<MAXCHANNELS; ch++)
+  {
+    mp->chan[ch].volume = 64;  // defaults to max volume for each channel (maybe not needed after all)
+  }
+  // init MOD play defaults
+  mp->mod = mod;
+  mp->numchannels = mod->Numchannels;
+  for (i=0; i<31; i++)
+    mp->samplefinetune[i] = mod->sample[i].Finetune;
+  mp->samplesready = (mod->loader == NULL)? ALLSAMPLESREADY : 0;
+  mp->format = opt->format;
+  mp->sfreq = sfreq;
+  mp->mixer = (opt->mixer == MIXER_AUTO || !MixerAvailable (opt->mixer))? BestMixer() : opt->mixer;
+  mp->phases = GetPhaseTable (sfreq, opt->format);
+  mp->output = (opt->output >= 0 && opt->output < NUMOUTPUTS)? opt->output : OUTPUT_U8MONO;
+  mp->interp = (opt->interp >= 0 && opt->interp < NUMINTERPS)? opt->interp : INTERP_NEAREST;
+  InitInterpTables();
+  // stereo panning as in the Amiga: channels 0 and 3 go left, 1 and 2 go right
+  // and so on for each group of 4 channels. With less separation, some of each
+  // channel goes to the other side. Both gains always add up to 256.
+  own = 128 + 128 * ((opt->separation < 0)? 0 : (opt->separation > 100)? 100 : opt->separation) / 100;
+  for (ch=0; ch<MAXCHANNELS; ch++)
+  {
+    mp->gainl[ch] = ((ch&3) == 0 || (ch&3) == 3)? own : 256 - own;
+    mp->gainr[ch] = 256 - mp->gainl[ch];
+  }
+  // a hard panned channel gets the same level it has in 8 bit mono output,
+  // with 8 more bits. The gains above already add those 8 bits
+  mp->outscale = ((mp->numchannels <= 4)? 256 : mixgains[mp->numchannels]) / 65536.0f;
+  if (mp->output == OUTPUT_F32STEREO)
+    mp->outscale /= 32768.0f;
+  mp->songpos = 0;
+  mp->patrow = 0;
+  mp->newsongpos = -1;
+  mp->newpatrow = -1;
+  mp->ticksperdiv = 6;
+  mp->bpm = 125;
+  mp->vbwave = 0;
+  mp->vbretrig = 1;
+  mp->trwave = 0;
+  mp->trretrig = 1;
+  mp->tambufplay = (sfreq*15L)/(mp->ticksperdiv*mp->bpm);  // 125 bpm, sfreq Hz, 6 ticks/div
+  mp->tickleft = 0;
+  mp->finished = 0;
+  mp->rndseed = 1;
+  AtomicStore (&mp->seekorder, -1);
+  mp->playback = NULL;
+  mp->stats = opt->stats;
+}
+
+// Rows already played by a scan of a song, and the tempo they were played
+// at. Where the song goes after a row only depends on the row itself, so
+// playing a row again at the same tempo means the song will loop forever
+// from there.
+typedef struct
+{
+  int *first;          // for each song position and division, index of its first visit in visits, or -1
+  struct
+  {
+    int speed, bpm;    // tempo the row was played at
+    uint32_t frame;    // when it was played
+    int next;          // next visit to the same row, or -1
+  } *visits;
+  int nvisits, maxvisits;
+} TRowVisits;
+
+// Function: gets rv ready for a new scan. Returns 0 if there isn't enough
+// memory
+int RowVisitsInit (TRowVisits *rv)
+{
+  int i;
+
+  memset (rv, 0, sizeof *rv);
+  rv->first = malloc (128 * 64 * sizeof *rv->first);
+  if (!rv->first)
+    return 0;
+  for (i=0; i<128*64; i++)
+    rv->first[i] = -1;
+  return 1;
+}
+
+// Function: frees the memory used by rv
+void RowVisitsFree (TRowVisits *rv)
+{
+  free (rv->first);
+  free (rv->visits);
+  memset (rv, 0, sizeof *rv);
+}
+
+// Function: takes note of a visit to division patrow of song position
+// songpos, at sample frame frame, with the given tempo. Returns 1 if it had
+// already been played at that tempo (and then, when it was is stored in
+// *firstframe), 0 if not, or -1 if there isn't enough memory.
+int RowVisitsCheck (TRowVisits *rv, int songpos, int patrow, int speed, int bpm, uint32_t frame, uint32_t *firstframe)
+{
+  int i, *pfirst = &rv->first[songpos * 64 + patrow];
+  void *p;
+
+  for (i = *pfirst; i >= 0; i = rv->visits[i].next)
+  {
+    if (rv->visits[i].speed == speed && rv->visits[i].bpm == bpm)
+    {
+      *firstframe = rv->visits[i].frame;
+      return 1;
+    }
+  }
+  if (rv->nvisits == rv->maxvisits)
+  {
+    p = realloc (rv->visits, (rv->maxvisits * 2 + 1024) * sizeof *rv->visits);
+    if (!p)
+      return -1;
+    rv->visits = p;
+    rv->maxvisits = rv->maxvisits * 2 + 1024;
+  }
+  rv->visits[rv->nvisits].speed = speed;
+  rv->visits[rv->nvisits].bpm = bpm;
+  rv->visits[rv->nvisits].frame = frame;
+  rv->visits[rv->nvisits].next = *pfirst;
+  *pfirst = rv->nvisits++;
+  return 0;
+}
+
+// Function: prints the time frames sample frames last at sfreq Hz to f, as
+// minutes, seconds and milliseconds
+void PrintTime (FILE *f, uint32_t frames, uint32_t sfreq)
+{
+  unsigned long ms = (unsigned long)((uint64_t)frames * 1000 / sfreq);
+
+  fprintf (f, "%lu:%02lu.%03lu", ms / 60000, (ms / 1000) % 60, ms % 1000);
+}
+
+// Function: prints what ScanMOD() found out about a song to f: how long it
+// lasts and, if it loops, where the loop starts
+void PrintScan (FILE *f, const TSongScan *scan, uint32_t sfreq)
+{
+  fprintf (f, "%lu samples (", (unsigned long)scan->lframes);
+  PrintTime (f, scan->lframes, sfreq);
+  fprintf (f, "), %lu divisions", (unsigned long)scan->nrows);
+  if (scan->loops)
+  {
+    fprintf (f, ", then loops back to position %d, division %d (", scan->looporder, scan->looprow);
+    PrintTime (f, scan->loopframe, sfreq);
+    fprintf (f, ")");
+  }
+}
+
+// Function: finds out how long the MOD in mod lasts when played as told by
+// opt, running only the sequencer: effects are processed as the player
+// does, tempo changes included, but nothing is mixed, so it goes thousands
+// of times faster than realtime. If the song jumps back to a row it has
+// already played at the same tempo, it would loop forever: the length is
+// then up to that jump, and where the loop starts is reported too.
+// Returns 1 if everything went OK.
+int ScanMOD (const TModule *mod, TPlayOptions *opt, TSongScan *scan)
+{
+  TModPlay mp;
+  TRowVisits rv;
+  int atrow, speed, bpm, res = 0;
+  uint32_t frame;
+
+  memset (scan, 0, sizeof *scan);
+  scan->looporder = scan->looprow = -1;
+  if (!RowVisitsInit (&rv))
+    return 0;
+  InitPlayMOD (&mp, mod, opt);
+  mp.samplesready = ALLSAMPLESREADY;  // the sequencer doesn't read sample data, so there's no need to wait for it
+  while (res == 0)
+  {
+    atrow = (mp.tick == 0 || mp.tick >= mp.ticksperdiv);  // next tick starts a division?
+    speed = mp.ticksperdiv;
+    bpm = mp.bpm;
+    frame = mp.frames;
+    if (SequenceTick (&mp) == 0)  // the song ended
+      break;
+    if (atrow)
+    {
+      res = RowVisitsCheck (&rv, mp.songpos, mp.patrow, speed, bpm, frame, &scan->loopframe);
+      if (res == 1)  // here we go again
+      {
+        scan->loops = 1;
+        scan->looporder = mp.songpos;
+        scan->looprow = mp.patrow;
+        mp.frames = frame;
+      }
+      else
+        scan->nrows++;
+    }
+  }
+  scan->lframes = mp.frames;
+  RowVisitsFree (&rv);
+  return res != -1;
+}
+
+// Function: frees the memory used by a seek index
+void FreeSeekIndex (TSeekIndex *idx)
+{
+  free (idx->points);
+  idx->points = NULL;
+  idx->npoints = idx->maxpoints = 0;
+}
+
+// Function: finds the snapshot of idx to start from, to get to the frame
+// frame (if order is -1) or to the start of division row of song position
+// order: the last one before it. If row is -1, it's the snapshot taken when
+// the song first gets to that song position, wherever division it starts at.
+static int FindSeekPoint (const TSeekIndex *idx, int order, int row, uint32_t frame)
+{
+  int i, lo, hi, best;
+
+  if (order < 0)  // binary search by time
+  {
+    lo = 0;
+    hi = idx->npoints - 1;
+    while (lo < hi)
+    {
+      i = (lo + hi + 1) / 2;
+      if (idx->points[i].state.frames <= frame)
+        lo = i;
+      else
+        hi = i - 1;
+    }
+    return lo;
+  }
+
+  // by position: the first time the song plays that song position, as it
+  // may be played again later. Snapshots are taken at the start of each
+  // song position, so there's always one to start from.
+  best = -1;
+  for (i=0; i<idx->npoints; i++)
+  {
+    if (idx->points[i].songpos == order && row < 0)
+      return i;
+    if (idx->points[i].songpos == order && idx->points[i].patrow <= row)
+      best = i;
+    else if (best >= 0)
+      break;
+  }
+  return best;
+}
+
+// Function: copies the state of player src into dst, all but seekorder,
+// which the user program may be setting meanwhile, and is only touched
+// with atomic operations
+static void CopyPlayer (TModPlay *dst, const TModPlay *src)
+{
+  memcpy (dst, src, offsetof (TModPlay, seekorder));
+}
+
+// Function: loads the state of the song from a snapshot into the player mp,
+// keeping everything that has to do with how it's being played: options,
+// seek index and samples already loaded. The new state is put together
+// aside and copied in one go, as the user program may be peeking at mp
+// while it plays.
+static void LoadSeekPoint (TModPlay *mp, const TSeekPoint *p)
+{
+  TModPlay nuevo = p->state;
+  int ch, last = -1;
+
+  // the channels of the snapshot may be playing samples this player never
+  // saw a note for, so it hasn't waited for them to be loaded yet
+  for (ch=0; ch<nuevo.numchannels; ch++)
+    if (nuevo.chan[ch].sample != NULL && nuevo.chan[ch].sample - mp->mod->sample > last)
+      last = (int)(nuevo.chan[ch].sample - mp->mod->sample);
+  nuevo.samplesready = mp->samplesready;
+  if (last >= nuevo.samplesready)
+    nuevo.samplesready = WaitSample (mp->mod, last);
+  nuevo.mixer = mp->mixer;
+  nuevo.output = mp->output;
+  nuevo.interp = mp->interp;
+  nuevo.outscale = mp->outscale;
+  memcpy (nuevo.gainl, mp->gainl, sizeof nuevo.gainl);
+  memcpy (nuevo.gainr, mp->gainr, sizeof nuevo.gainr);
+  nuevo.tickleft = 0;  // snapshots are taken at the start of a tick
+  nuevo.seekindex = mp->seekindex;
+  nuevo.playback = mp->playback;
+  nuevo.stats = mp->stats;
+  nuevo.newrow = 1;
+  CopyPlayer (mp, &nuevo);
+}
+
+// Function: moves the player mp to another point of the song, using the
+// snapshots in idx: to the start of the tick that holds the sample frame
+// frame (if order is -1), or else to the start of division row of song
+// position order (or wherever the song enters it, if row is -1). Only the sequencer runs from the nearest snapshot on, so
+// this takes a few microseconds wherever the target is. Returns 1 if the
+// player got there, or 0 if that point isn't in the song (the player is not
+// changed then).
+int SeekMOD (TModPlay *mp, const TSeekIndex *idx, int order, int row, uint32_t frame)
+{
+  TModPlay antes, inicio;
+  int i, atrow;
+
+  if (idx == NULL || idx->npoints == 0 || idx->sfreq != mp->sfreq || idx->format != mp->format)  // the snapshot would be out of tune
+    return 0;
+  i = FindSeekPoint (idx, order, row, frame);
+  if (i < 0)
+    return 0;
+
+  CopyPlayer (&antes, mp);
+  LoadSeekPoint (mp, &idx->points[i]);
+  if (order >= 0 && row < 0)
+    return 1;
+  while (!mp->finished)
+  {
+    atrow = (mp->tick == 0 || mp->tick >= mp->ticksperdiv);  // next tick starts a division?
+    if (order < 0)
+    {
+      if (mp->frames >= frame)
+        return 1;
+      if (!atrow && mp->frames + mp->tambufplay > frame)  // the tick with the target frame. Ticks within a division are all equal
+        return 1;
+    }
+    else if (atrow && i+1 < idx->npoints && mp->frames >= idx->points[i+1].state.frames)  // went past the next snapshot without finding it
+      break;
+    if (atrow)  // tempo changes here, so we may have to come back
+      CopyPlayer (&inicio, mp);
+    SkipTick (mp);
+    if (atrow && !mp->finished && ((order < 0)? mp->frames > frame : (mp->songpos == order && mp->patrow == row)))
+    {
+      CopyPlayer (mp, &inicio);
+      return 1;
+    }
+  }
+  CopyPlayer (mp, &antes);
+  return 0;
+}
+
+// Function: builds the seek index idx for mod, played as told by opt: a
+// snapshot of the player is taken at the start of each song position and
+// every rowsperpoint divisions, running only the sequencer through the whole
+// song (or its first maxseconds seconds). For songs that loop forever, it
+// stops where the song jumps back (see ScanMOD()). The length of the song,
+// in sample frames, ends in idx->lframes. Returns 1 if everything went OK.
+int BuildSeekIndex (TSeekIndex *idx, const TModule *mod, TPlayOptions *opt, int rowsperpoint, uint32_t maxseconds)
+{
+  TModPlay mp, inicio;
+  TSeekPoint *p;
+  TRowVisits rv;
+  uint32_t lmax, frame;
+  int atrow, rows = 0, lastpos = -1;
+  size_t n;
+
+  memset (idx, 0, sizeof *idx);
+  idx->sfreq = opt->sfreq;
+  idx->format = opt->format;
+  if (!RowVisitsInit (&rv))
+    return 0;
+  InitPlayMOD (&mp, mod, opt);
+  mp.samplesready = ALLSAMPLESREADY;  // the sequencer doesn't read sample data, so there's no need to wait for it
+  lmax = (maxseconds > 0 && maxseconds < 0xFFFFFFFFUL / opt->sfreq)? maxseconds * opt->sfreq : 0xFFFFFFFFUL;
+  while (!mp.finished && mp.frames < lmax)
+  {
+    atrow = (mp.tick == 0 || mp.tick >= mp.ticksperdiv);
+    if (atrow)
+      inicio = mp;
+    n = SkipTick (&mp);
+    if (atrow && n > 0 && RowVisitsCheck (&rv, mp.songpos, mp.patrow, inicio.ticksperdiv, inicio.bpm, inicio.frames, &frame) != 0)  // jumped back, or out of memory
+    {
+      mp.frames = inicio.frames;
+      break;
+    }
+    if (atrow && n > 0 && (mp.songpos != lastpos || rows >= rowsperpoint))
+    {
+      if (idx->npoints == idx->maxpoints)
+      {
+        p = realloc (idx->points, (idx->maxpoints * 2 + 64) * sizeof *p);
+        if (!p)
+        {
+          FreeSeekIndex (idx);
+          RowVisitsFree (&rv);
+          return 0;
+        }
+        idx->points = p;
+        idx->maxpoints = idx->maxpoints * 2 + 64;
+      }
+      idx->points[idx->npoints].state = inicio;
+      idx->points[idx->npoints].songpos = mp.songpos;
+      idx->points[idx->npoints].patrow = mp.patrow;
+      idx->npoints++;
+      lastpos = mp.songpos;
+      rows = 0;
+    }
+    if (atrow)
+      rows++;
+  }
+  idx->lframes = mp.frames;
+  RowVisitsFree (&rv);
+  return 1;
+}
+
+// Playing in the background. A render thread keeps the ring up to highwater
+// bytes ahead of the sound card, and the sound card just takes blocks of
+// lblock bytes out of it (see FeedDevice()), so a slow tick only eats into
+// what is in the ring instead of making the sound card wait. How far ahead
+// the ring is, plus the buffers queued in the sound card, is the latency.
+struct TPlayback
+{
+  TModPlay *mp;
+  TAudioRing ring;
+  uint32_t lblock;        // bytes in a block for the sound card
+  uint32_t highwater;     // the render thread stops once the ring has this many bytes
+  THandle thread;
+  int hasthread;          // 0 if the render thread couldn't be created. PlayingMOD() renders then
+  int deviceopen;         // 1 once the sound card has been opened
+  TEvent wake;            // signalled when the render thread may have work to do
+  volatile long feeding;  // 1 while someone is sending blocks to the sound card
+  volatile long inflight; // blocks queued in the sound card
+  volatile long rendered; // 1 once the whole song is in the ring
+  volatile long played;   // 1 once the whole song has been sent to the sound card
+  volatile long stop;     // 1 to stop everything
+  volatile long underruns;  // times the sound card ran out of blocks before the song ended
+};
+
+// Device blocks last this long, in milliseconds
+#define PLAYBLOCKMS 20
+
+// Function: renders the song straight into the ring, with no buffer in
+// between, until the ring reaches its high-water mark or the song ends. If
+// the user wants to go elsewhere in the song, the player goes there first.
+static void RenderAhead (TPlayback *pb)
+{
+  TModPlay *mp = pb->mp;
+  uint32_t lframe = OutputFrameSize (mp->output);
+  uint32_t used, lspace;
+  uint8_t *p;
+  size_t n;
+  long order;
+
+  while (!AtomicLoad (&pb->rendered) && !AtomicLoad (&pb->stop) && (used = RingUsed (&pb->ring)) < pb->highwater)
+  {
+    order = AtomicSwap (&mp->seekorder, -1);
+    if (order >= 0)  // the user wants to go elsewhere in the song
+      SeekMOD (mp, mp->seekindex, (int)order, -1, 0);
+    p = RingSpace (&pb->ring, &lspace);
+    if (lspace > pb->highwater - used)
+      lspace = pb->highwater - used;
+    n = lspace / lframe;
+    if (n == 0)
+      break;
+    n = RenderFrames (mp, p, n);
+    RingCommit (&pb->ring, n * lframe);
+    if (mp->finished)
+      AtomicStore (&pb->rendered, 1);
+  }
+}
+
+// Function: returns 1 if the sound card has room for a block, and there is
+// one in the ring (or what's left of the song, once it's all there)
+static int DeviceWantsBlock (TPlayback *pb)
+{
+  return !AtomicLoad (&pb->stop) && !AtomicLoad (&pb->played) &&
+         AtomicLoad (&pb->inflight) < MAXAUDIOBUFFERS &&
+         (AtomicLoad (&pb->rendered) || RingUsed (&pb->ring) >= pb->lblock);
+}
+
+// Function: sends blocks from the ring to the sound card while it has room
+// for them. Both the sound card (when a block is done) and the render thread
+// (as the sound card may have run dry waiting for it) call this. Only one of
+// them sends at a time: if the other one is at it, this one just leaves, and
+// the other one checks again for work once it's done, so nothing is missed.
+static void FeedDevice (TPlayback *pb)
+{
+  TPlayStats *st = pb->mp->stats;
+  uint32_t n;
+  double t;
+
+  while (DeviceWantsBlock (pb) && AtomicSwap (&pb->feeding, 1) == 0)
+  {
+    while (DeviceWantsBlock (pb))
+    {
+      n = RingUsed (&pb->ring);
+      if (n == 0)  // the song is all there, and has all been sent
+      {
+        AtomicStore (&pb->played, 1);
+        break;
+      }
+      if (n > pb->lblock)
+        n = pb->lblock;
+      AtomicAdd (&pb->inflight, 1);
+      if (st)
+        t = TimerNow();
+      ReproducirAudio ((uint8_t *)RingPeek (&pb->ring), n);  // it copies the block, so it can go back to the ring
+      if (st)
+      {
+        AtomicAdd (&st->seqdevice, 1);
+        StageStatsAdd (&st->stage[STAGE_SUBMIT], ElapsedNs (t));
+        AtomicAdd (&st->seqdevice, 1);
+      }
+      RingSkip (&pb->ring, n);
+      EventSignal (&pb->wake);  // there is room in the ring again
+    }
+    AtomicStore (&pb->feeding, 0);
+  }
+}
+
+// Function: this is what the audio device calls each time a block has
+// finished playing. datos is the playback given to AbrirAudioCallBack(). It
+// doesn't render anything: it just takes the next block out of the ring.
+static void DeviceBlockDone (void *datos)
+{
+  TPlayback *pb = datos;
+
+  if (AtomicAdd (&pb->inflight, -1) == 0 && !AtomicLoad (&pb->rendered) && RingUsed (&pb->ring) < pb->lblock)
+    AtomicAdd (&pb->underruns, 1);  // the sound card has nothing left to play
+  FeedDevice (pb);
+}
+
+// Function: the render thread. Keeps the ring full up to its high-water
+// mark until the whole song is in it, and sleeps in between.
+static void RenderThread (void *datos)
+{
+  TPlayback *pb = datos;
+
+  while (!AtomicLoad (&pb->stop) && !AtomicLoad (&pb->rendered))
+  {
+    RenderAhead (pb);
+    FeedDevice (pb);
+    if (!AtomicLoad (&pb->rendered))
+      EventWait (&pb->wake);
+  }
+}
+
+// Function: finishes MOD audio playing.
+void EndPlayMOD (TModPlay *mp)
+{
+  TPlayback *pb = mp->playback;
+
+  if (pb)
+  {
+    AtomicStore (&pb->stop, 1);
+    EventSignal (&pb->wake);
+    if (pb->hasthread)
+      ThreadJoin (pb->thread);
+    if (pb->deviceopen)
+      CerrarAudio();
+    RingDestroy (&pb->ring);
+    EventDestroy (&pb->wake);
+    free (pb);
+    mp->playback = NULL;
+  }
+  mp->finished = 1;
+  if (mp->seekindex)
+  {
+    FreeSeekIndex (mp->seekindex);
+    free (mp->seekindex);
+    mp->seekindex = NULL;
+  }
+}
+
+// Function: moves the player mp to where opt says playing must start, using
+// the seek index idx. Returns 1 if it could get there.
+int SeekMODStart (TModPlay *mp, const TSeekIndex *idx, TPlayOptions *opt)
+{
+  if (opt->startorder == 0 && opt->startrow == 0)  // the player is there already
+    return 1;
+  return SeekMOD (mp, idx, opt->startorder, opt->startrow, (uint32_t)((uint64_t)opt->startms * opt->sfreq / 1000));
+}
+
+// Function: moves the player mp, just set up for mod, to where opt says a
+// render must start, with a seek index of its own that is thrown away
+// afterwards. The index covers the song, not just what is going to be
+// rendered, as the start may be past that. Returns 1 if it could get there.
+int SeekRenderStart (TModPlay *mp, const TModule *mod, TPlayOptions *opt)
+{
+  TSeekIndex idx;
+  int ok;
+
+  if (opt->startorder == 0 && opt->startrow == 0)  // the player is there already
+    return 1;
+  ok = BuildSeekIndex (&idx, mod, opt, SEEKROWS, SEEKMAXSECONDS) && SeekMODStart (mp, &idx, opt);
+  FreeSeekIndex (&idx);
+  return ok;
+}
+
+// Function: starts playing the MOD in mod on the audio device, using the
+// player context mp. A seek index is built first, so the player can be
+// moved around the song while playing (see RenderAhead()). The ring is filled
+// up to the high-water mark in opt before the sound card starts, and then
+// the render thread takes over. It returns 1 if playing started.
+int BeginPlayMOD (TModPlay *mp, const TModule *mod, TPlayOptions *opt)
+{
+  TPlayback *pb;
+  uint32_t lframe;
+
+  InitPlayMOD (mp, mod, opt);
+  lframe = OutputFrameSize (mp->output);
+  mp->seekindex = malloc (sizeof *mp->seekindex);
+  if (mp->seekindex && !BuildSeekIndex (mp->seekindex, mod, opt, SEEKROWS, SEEKMAXSECONDS))  // it can play without it, though
+  {
+    free (mp->seekindex);
+    mp->seekindex = NULL;
+  }
+  if (!SeekMODStart (mp, mp->seekindex, opt))
+  {
+    EndPlayMOD (mp);
+    return 0;
+  }
+
+  // the ring has room for the high-water mark plus a block, and it is a
+  // whole number of device blocks, so blocks never wrap around it
+  pb = calloc (1, sizeof *pb);
+  if (!pb)
+  {
+    EndPlayMOD (mp);
+    return 0;
+  }
+  pb->mp = mp;
+  pb->lblock = (mp->sfreq * PLAYBLOCKMS / 1000) * lframe;
+  pb->highwater = (uint32_t)((uint64_t)opt->highwaterms * mp->sfreq / 1000) * lframe;
+  if (pb->highwater < pb->lblock)  // the sound card would wait for a block the render thread never gets to
+    pb->highwater = pb->lblock;
+  EventInit (&pb->wake);
+  mp->playback = pb;
+  if (!RingCreate (&pb->ring, (pb->highwater + pb->lblock - 1) / pb->lblock * pb->lblock + pb->lblock))
+  {
+    EndPlayMOD (mp);
+    return 0;
+  }
+  RenderAhead (pb);
+
+  // open audio device with a user callback function which will be executed
+  // each time an audio block has finished playing
+  if (AbrirAudioCallBack (mp->sfreq, outputchannels[mp->output], outputbits[mp->output], &DeviceBlockDone, pb) != 0)
+  {
+    EndPlayMOD (mp);
+    return 0;
+  }
+  pb->deviceopen = 1;
+
+  // now all audio buffers are empty, so we fill all of them
+  FeedDevice (pb);
+  pb->hasthread = ThreadCreate (&pb->thread, RenderThread, pb);
+  return 1;
+}
+
+// Function: returns 1 while the MOD is still being played by mp. If there
+// is no render thread (as in DOS), this is where the rendering is done, so
+// it has to be called often enough to keep the sound card fed.
+int PlayingMOD (TModPlay *mp)
+{
+  TPlayback *pb = mp->playback;
+
+  if (!pb->hasthread)
+  {
+    RenderAhead (pb);
+    FeedDevice (pb);
+  }
+  return !AtomicLoad (&pb->played);
+}
+
+// Function: gets a consistent copy of the statistics being kept by the
+// player mp into snap, while it plays. Any thread can call it, as often
+// as it wants: the player never waits for it. Returns 0 if mp keeps no
+// statistics.
+int GetPlayStats (TModPlay *mp, TPlayStats *snap)
+{
+  TPlayStats *st = mp->stats;
+  long seqrender, seqdevice;
+
+  if (!st)
+    return 0;
+  do
+  {
+    seqrender = AtomicLoad (&st->seqrender);
+    seqdevice = AtomicLoad (&st->seqdevice);
+    *snap = *st;
+  }
+  while ((seqrender & 1) || (seqdevice & 1) ||
+         AtomicLoad (&st->seqrender) != seqrender || AtomicLoad (&st->seqdevice) != seqdevice);  // some thread was writing
+  snap->underruns = mp->playback? AtomicLoad (&mp->playback->underruns) : 0;
+  return 1;
+}
+
+// Function: writes the statistics in snap to f, as a JSON object
+void WritePlayStats (FILE *f, const TPlayStats *snap)
+{
+  int s, b;
+  const TStageStats *st;
+
+  fprintf (f, "{\n  \"ticks\": %lu,\n  \"lateticks\": %lu,\n  \"underruns\": %ld,\n",
+           (unsigned long)snap->ticks, (unsigned long)snap->lateticks, snap->underruns);
+  fprintf (f, "  \"cpuload\": {\"average\": %.4f, \"peak\": %.3f, \"histogram\": [",
+           (snap->audions > 0)? (double)snap->renderns / snap->audions : 0.0, snap->peakload / 1000.0);
+  for (b=0; b<LOADBUCKETS; b++)
+    fprintf (f, "%s%lu", (b > 0)? ", " : "", (unsigned long)snap->loadhist[b]);
+  fprintf (f, "]},\n  \"stages\": {\n");
+  for (s=0; s<NUMSTAGES; s++)
+  {
+    st = &snap->stage[s];
+    fprintf (f, "    \"%s\": {\"count\": %lu, \"totalns\": %.0f, \"maxns\": %lu, \"histogram\": [",
+             stagenames[s], (unsigned long)st->count, (double)st->totalns, (unsigned long)st->maxns);
+    for (b=0; b<STATBUCKETS; b++)
+      fprintf (f, "%s%lu", (b > 0)? ", " : "", (unsigned long)st->hist[b]);
+    fprintf (f, "]}%s\n", (s < NUMSTAGES-1)? "," : "");
+  }
+  fprintf (f, "  }\n}\n");
+}
+
+// Function: writes the statistics in snap to the file fname, so a
+// monitoring agent can poll it. The file is written aside and renamed over
+// the old one, so whoever reads it never gets half a snapshot. Returns 1 if
+// OK.
+int ExportPlayStats (const TPlayStats *snap, const char *fname)
+{
+  char tmpname[1024];
+  FILE *f;
+  int ok;
+
+  snprintf (tmpname, sizeof tmpname, "%s.tmp", fname);
+  f = fopen (tmpname, "w");
+  if (!f)
+    return 0;
+  WritePlayStats (f, snap);
+  ok = (fclose (f) == 0);
+  if (ok && rename (tmpname, fname) != 0)  // Windows won't rename over an existing file
+  {
+    remove (fname);
+    ok = (rename (tmpname, fname) == 0);
+  }
+  return ok;
+}
+
+// Function: returns the most sample frames of lframe bytes a render can
+// have: as many as fit in a WAV file, or maxseconds seconds of audio if
+// that's less (and maxseconds is not 0)
+uint32_t RenderLimit (uint32_t sfreq, size_t lframe, uint32_t maxseconds)
+{
+  uint32_t lmax = (0xFFFFFFFFUL - WAVHEADERSIZE) / lframe;
+
+  if (maxseconds > 0 && maxseconds < lmax / sfreq)
+    lmax = maxseconds * sfreq;
+  return lmax;
+}
+
+// Function: renders the MOD loaded into mod from start to end into the
+// stream f, without any audio device involved, so it goes as fast as the CPU
+// allows. If opt says to start elsewhere, a seek index is built to get there. Audio is written as a WAV file (if wav is 1) or as raw PCM, in the
+// output format given in opt. Rendering stops after maxseconds seconds of
+// audio (if not 0), to protect against modules that jump back and loop
+// forever. The number of sample frames rendered is stored in *lsamples.
+// Returns 1 if everything went OK.
+int RenderMODToStream (const TModule *mod, FILE *f, int wav, TPlayOptions *opt, uint32_t maxseconds, uint32_t *lsamples)
+{
+  uint32_t sfreq = opt->sfreq;
+  TModPlay mplay;
+  uint8_t *sbuffer;
+  size_t lbuffer, lframe;
+  uint32_t ltotal, lmax;
+  int nchannels, bits;
+  int ok;
+
+  *lsamples = 0;
+  InitPlayMOD (&mplay, mod, opt);
+  lframe = OutputFrameSize (mplay.output);
+  nchannels = outputchannels[mplay.output];
+  bits = outputbits[mplay.output];
+  if (!SeekRenderStart (&mplay, mod, opt))
+    return 0;
+  sbuffer = malloc (RENDERBLOCKFRAMES * lframe);
+  if (!sbuffer)
+    return 0;
+
+  lmax = RenderLimit (sfreq, lframe, maxseconds);
+  ok = 1;
+  if (wav)  // we don't know the final size yet. The header is rewritten at the end, if possible
+    ok = WriteWavHeader (f, sfreq, nchannels, bits, bits == 32, 0xFFFFFFFFUL);
+
+  ltotal = 0;
+  while (ok && mplay.finished == 0 && ltotal < lmax)
+  {
+    lbuffer = lmax - ltotal;
+    if (lbuffer > RENDERBLOCKFRAMES)
+      lbuffer = RENDERBLOCKFRAMES;
+    lbuffer = RenderFrames (&mplay, sbuffer, lbuffer);
+    if (fwrite (sbuffer, lframe, lbuffer, f) != lbuffer)
+      ok = 0;
+    ltotal += lbuffer;
+  }
+  free (sbuffer);
+
+  if (ok && wav && fseek (f, 0, SEEK_SET) == 0)  // patch the header with the actual size, if this is not a pipe
+    ok = WriteWavHeader (f, sfreq, nchannels, bits, bits == 32, ltotal * lframe);
+  *lsamples = ltotal;
+  return ok;
+}
+
+// A render of a single MOD can be split into segments, all of them rendered
+// at the same time (see RenderMODParallel()). Each one starts at the start
+// of a division, from a snapshot of the player taken there by running just
+// the sequencer, which is exactly how a player that has played the song up
+// to there would be. So the segments, one after the other, are exactly the
+// song.
+#define SEGMENTSPERTHREAD 4  // more segments than threads, so no thread is left idle while the slowest one ends
+#define MINSEGMENTSECONDS 2  // shorter segments are not worth a snapshot
+
+typedef struct
+{
+  TModPlay state;     // the player, just before the segment starts
+  uint32_t lframes;   // length of the segment, in sample frames
+  uint8_t *buffer;    // what it sounds like. NULL if it hasn't been rendered, or it's been written already
+  int done;           // 1 once it's been rendered (or it failed to)
+} TSegment;
+
+typedef struct
+{
+  TSegment *segments;
+  int nsegments;
+  int nextwrite;      // first segment not written yet
+  FILE *f;
+  size_t lframe;      // bytes in a sample frame
+  int ok;
+  TMutex lock;        // for everything above, once workers have started
+} TParallelRender;
+
+// Function: job of the work pool for RenderMODParallel(): renders a segment.
+// Segments must be written in order, so whoever finishes the next one to
+// write writes it, and any other ones after it that were done already.
+// Workers take their jobs from the back of their queues, so jobs go to
+// segments in reverse order: that way, each worker renders its own
+// segments from the first one on, and few of them are ever waiting to be
+// written.
+static void RenderSegmentJob (int job, int worker, void *data)
+{
+  TParallelRender *pr = data;
+  TSegment *s = &pr->segments[pr->nsegments - 1 - job];
+  uint8_t *buffer;
+  int ok;
+
+  buffer = (s->lframes > 0)? malloc ((size_t)s->lframes * pr->lframe) : NULL;
+  ok = (s->lframes == 0 || (buffer != NULL && RenderFrames (&s->state, buffer, s->lframes) == s->lframes));
+
+  MutexLock (&pr->lock);
+  s->buffer = buffer;
+  s->done = 1;
+  if (!ok)
+    pr->ok = 0;
+  while (pr->nextwrite < pr->nsegments && pr->segments[pr->nextwrite].done)
+  {
+    s = &pr->segments[pr->nextwrite];
+    if (pr->ok && fwrite (s->buffer, pr->lframe, s->lframes, pr->f) != s->lframes)
+      pr->ok = 0;
+    free (s->buffer);
+    s->buffer = NULL;
+    pr->nextwrite++;
+  }
+  MutexUnlock (&pr->lock);
+}
+
+// Function: renders the MOD loaded into mod as RenderMODToStream() does,
+// with exactly the same output, but using nthreads threads (0 for one for
+// each CPU). The sequencer runs through the song twice first, which takes a
+// fraction of a millisecond: once to find out how long the render is, and
+// once more to take a snapshot of the player at the first division that
+// starts after each cut point, so the segments are about the same length.
+// Then the segments are rendered at once, and written in order as they are
+// done. Returns 1 if everything went OK.
+int RenderMODParallel (const TModule *mod, FILE *f, int wav, TPlayOptions *opt, uint32_t maxseconds, int nthreads, uint32_t *lsamples)
+{
+  uint32_t sfreq = opt->sfreq;
+  TModPlay mplay, mp;
+  TParallelRender pr;
+  uint32_t ltotal, lmax, pos, start;
+  int nchannels, bits, nsegments, k;
+
+  *lsamples = 0;
+  if (nthreads <= 0)
+    nthreads = NumCPUs();
+  InitPlayMOD (&mplay, mod, opt);
+  pr.lframe = OutputFrameSize (mplay.output);
+  nchannels = outputchannels[mplay.output];
+  bits = outputbits[mplay.output];
+  if (!SeekRenderStart (&mplay, mod, opt))
+    return 0;
+
+  // how long the render is: until the song ends, or up to the limit
+  lmax = RenderLimit (sfreq, pr.lframe, maxseconds);
+  mp = mplay;
+  ltotal = 0;
+  while (!mp.finished && ltotal < lmax)
+    ltotal += SkipTick (&mp);
+  if (ltotal > lmax)
+    ltotal = lmax;
+
+  // where each segment starts
+  nsegments = ltotal / (MINSEGMENTSECONDS * sfreq);
+  if (nsegments > nthreads * SEGMENTSPERTHREAD)
+    nsegments = nthreads * SEGMENTSPERTHREAD;
+  if (nsegments < 1)
+    nsegments = 1;
+  pr.segments = calloc (nsegments, sizeof *pr.segments);
+  if (!pr.segments)
+    return 0;
+  pr.segments[0].state = mplay;
+  mp = mplay;
+  pos = 0;
+  start = 0;
+  for (k=1; k < nsegments && !mp.finished && pos < ltotal; )
+  {
+    if ((mp.tick == 0 || mp.tick >= mp.ticksperdiv) && pos >= (uint64_t)ltotal * k / nsegments)  // next tick starts a division past the cut point
+    {
+      pr.segments[k-1].lframes = pos - start;
+      pr.segments[k].state = mp;
+      start = pos;
+      k++;
+    }
+    pos += SkipTick (&mp);
+  }
+  nsegments = k;
+  pr.segments[nsegments-1].lframes = ltotal - start;
+
+  pr.nsegments = nsegments;
+  pr.nextwrite = 0;
+  pr.f = f;
+  pr.ok = 1;
+  if (wav)  // as RenderMODToStream() does
+    pr.ok = WriteWavHeader (f, sfreq, nchannels, bits, bits == 32, 0xFFFFFFFFUL);
+  if (pr.ok)
+  {
+    MutexInit (&pr.lock);
+    if (!RunWorkPool (nthreads, nsegments, RenderSegmentJob, &pr))
+      pr.ok = 0;
+    MutexDestroy (&pr.lock);
+  }
+  for (k=0; k<nsegments; k++)  // left if something failed
+    free (pr.segments[k].buffer);
+  free (pr.segments);
+
+  if (pr.ok && wav && fseek (f, 0, SEEK_SET) == 0)  // patch the header with the actual size, if this is not a pipe
+    pr.ok = WriteWavHeader (f, sfreq, nchannels, bits, bits == 32, ltotal * pr.lframe);
+  *lsamples = ltotal;
+  return pr.ok;
+}
+
+// Function: renders the MOD loaded into mod as RenderMODToStream() does, to
+// the file outname, or to the standard output if outname is "-", using
+// nthreads threads (see RenderMODParallel()). Timing statistics are taken
+// for a single player, so with them it all goes in one thread. How fast it
+// went is reported on the standard error. Returns 1 if everything went OK.
+int RenderMOD (const TModule *mod, char outname[], int wav, TPlayOptions *opt, uint32_t maxseconds, int nthreads)
+{
+  uint32_t sfreq = opt->sfreq;
+  FILE *f;
+  uint32_t ltotal;
+  double tstart, telapsed, tsong;
+  int ok;
+
+  if (strcmp (outname, "-") == 0)
+  {
+    f = stdout;
+    SetBinaryMode (f);
+  }
+  else
+    f = fopen (outname, "wb");
+  if (!f)
+  {
+    fprintf (stderr, "ERROR creating [%s].\n", outname);
+    return 0;
+  }
+
+  if (nthreads <= 0)
+    nthreads = NumCPUs();
+  if (opt->stats != NULL)
+    nthreads = 1;
+  tstart = TimerNow();
+  if (nthreads > 1)
+    ok = RenderMODParallel (mod, f, wav, opt, maxseconds, nthreads, &ltotal);
+  else
+    ok = RenderMODToStream (mod, f, wav, opt, maxseconds, &ltotal);
+  telapsed = TimerNow() - tstart;
+  if (f != stdout)
+    fclose (f);
+  else
+    fflush (f);
+
+  tsong = (double)ltotal / sfreq;
+  fprintf (stderr, "Rendered %lu sample frames (%.2f s of audio) in %.3f s", (unsigned long)ltotal, tsong, telapsed);
+  if (telapsed > 0)
+    fprintf (stderr, ", %.1fx faster than realtime", tsong / telapsed);
+  if (ltotal > 0)  // what each mixer and filter costs
+    fprintf (stderr, ", %.1f ns/sample", telapsed * 1e9 / ltotal);
+  fprintf (stderr, " (threads: %d, mixer: %s, output: %s, interpolation: %s)\n", nthreads, mixernames[(opt->mixer == MIXER_AUTO || !MixerAvailable (opt->mixer))? BestMixer() : opt->mixer],
+           outputnames[(opt->output >= 0 && opt->output < NUMOUTPUTS)? opt->output : OUTPUT_U8MONO],
+           interpnames[(opt->interp >= 0 && opt->interp < NUMINTERPS)? opt->interp : INTERP_NEAREST]);
+  if (!ok)
+    fprintf (stderr, "ERROR writing to [%s].\n", outname);
+  return ok;
+}
+
+// How many modules not in use a batch render keeps parsed, in case they
+// are listed again
+#define MODCACHESIZE 64
+
+// Information about each module in a batch render
+typedef struct
+{
+  char *fname;        // module to render
+  int ok;             // 1 if it was loaded and rendered
+  uint32_t lsamples;  // how many samples were rendered
+  double tload;       // time spent loading it, in seconds
+  double trender;     // time spent rendering and writing it (or scanning it), in seconds
+  TSongScan scan;     // what a scan found out, for scan only batches
+} TBatchJob;
+
+// Information shared by all the workers in a batch render
+typedef struct
+{
+  TBatchJob *jobs;
+  char *outdir;         // where to write WAV files. NULL to write them next to each module
+  TPlayOptions *opt;
+  uint32_t maxseconds;
+  TModCache *cache;     // modules listed more than once are loaded only once
+  int scanonly;         // 1 to just find out how long each module lasts, with ScanMOD()
+  TMutex lockprint;     // so lines from different workers don't get mixed
+} TBatch;
+
+// Function: builds the name of the WAV file for the module fname: same name
+// with a .WAV extension instead of .MOD, placed in outdir if it's not NULL
+void BatchOutputName (char outname[], size_t loutname, char fname[], char outdir[])
+{
+  char *base;
+  size_t l;
+
+  base = fname;
+  if (outdir)  // strip the path of the module, if it's going elsewhere
+  {
+    for (base = fname + strlen(fname); base > fname && base[-1] != '/' && base[-1] != '\\' && base[-1] != ':'; base--)
+      ;
+    snprintf (outname, loutname, "%s%c%s", outdir, PATHSEP, base);
+  }
+  else
+    snprintf (outname, loutname, "%s", fname);
+  l = strlen (outname);
+  if (l >= 4 && stricmp (outname + l - 4, ".MOD") == 0)
+    outname[l-4] = '\0';
+  l = strlen (outname);
+  snprintf (outname + l, loutname - l, ".wav");
+}
+
+// Function: the job each worker does for each module in a batch: load it,
+// render it and write it as a WAV file.
+void BatchRenderJob (int job, int worker, void *data)
+{
+  TBatch *b = data;
+  TBatchJob *j = &b->jobs[job];
+  const TModule *mod;
+  char outname[1024];
+  FILE *f;
+  double t0, t1, t2;
+
+  j->ok = 0;
+  t0 = TimerNow();
+  mod = ModCacheLoad (b->cache, j->fname);
+  if (mod != NULL)
+  {
+    t1 = TimerNow();
+    if (b->scanonly)
+    {
+      j->ok = ScanMOD (mod, b->opt, &j->scan);
+      j->lsamples = j->scan.lframes;
+    }
+    else
+    {
+      BatchOutputName (outname, sizeof outname, j->fname, b->outdir);
+      f = fopen (outname, "wb");
+      if (f)
+      {
+        j->ok = RenderMODToStream (mod, f, 1, b->opt, b->maxseconds, &j->lsamples);
+        fclose (f);
+      }
+    }
+    t2 = TimerNow();
+    j->tload = t1 - t0;
+    j->trender = t2 - t1;
+    ModCacheRelease (b->cache, mod);
+  }
+
+  MutexLock (&b->lockprint);
+  if (j->ok && b->scanonly)
+  {
+    printf ("[%d] %s: ", worker, j->fname);
+    PrintScan (stdout, &j->scan, b->opt->sfreq);
+    printf (", load %.1f ms, scan %.3f ms, %.0fx realtime\n", j->tload*1000, j->trender*1000,
+            (j->trender > 0)? (double)j->lsamples / b->opt->sfreq / j->trender : 0.0);
+  }
+  else if (j->ok)
+    printf ("[%d] %s: %lu samples, load %.1f ms, render %.1f ms, %.1fx realtime, %.0f samples/s\n",
+            worker, j->fname, (unsigned long)j->lsamples, j->tload*1000, j->trender*1000,
+            (j->trender > 0)? (double)j->lsamples / b->opt->sfreq / j->trender : 0.0,
+            (j->trender > 0)? j->lsamples / j->trender : 0.0);
+  else
+    printf ("[%d] %s: ERROR loading or rendering\n", worker, j->fname);
+  fflush (stdout);
+  MutexUnlock (&b->lockprint);
+}
+
+// Function: adds a file name to the list of modules of a batch render.
+// Returns 0 if there isn't enough memory.
+int BatchAddFile (char ***fnames, int *nfiles, int *maxfiles, char fname[])
+{
+  char **p;
+
+  if (*nfiles == *maxfiles)
+  {
+    p = realloc (*fnames, (*maxfiles * 2 + 16) * sizeof *p);
+    if (!p)
+      return 0;
+    *fnames = p;
+    *maxfiles = *maxfiles * 2 + 16;
+  }
+  (*fnames)[*nfiles] = malloc (strlen(fname) + 1);
+  if (!(*fnames)[*nfiles])
+    return 0;
+  strcpy ((*fnames)[*nfiles], fname);
+  (*nfiles)++;
+  return 1;
+}
+
+// Function: renders a whole collection of modules to WAV files, using
+// nthreads threads (0 to use one for each CPU). source is either a directory
+// (all files named *.MOD or MOD.* in it are rendered) or a manifest: a text
+// file with a module file name in each line. WAV files are written into
+// outdir, or next to each module if outdir is NULL. Throughput is printed
+// for each module and for the whole batch. If scanonly is 1, nothing is
+// rendered: each module is just scanned to find out how long it lasts.
+// Returns how many modules failed.
+int BatchRenderMOD (char source[], char outdir[], int nthreads, TPlayOptions *opt, uint32_t maxseconds, int scanonly)
+{
+  TBatch b;
+  TModCache cache;
+  char **fnames = NULL;
+  int nfiles = 0, maxfiles = 0;
+  int i, nfailed;
+  DIR *d;
+  struct dirent *de;
+  FILE *f;
+  char line[1024];
+  size_t l;
+  double tstart, telapsed, tsong;
+  double totalsamples;
+
+  d = opendir (source);
+  if (d)  // source is a directory. Take all modules from it
+  {
+    while ((de = readdir (d)) != NULL)
+    {
+      l = strlen (de->d_name);
+      if ((l > 4 && stricmp (de->d_name + l - 4, ".MOD") == 0) || (l > 4 && strnicmp (de->d_name, "MOD.", 4) == 0))
+      {
+        snprintf (line, sizeof line, "%s%c%s", source, PATHSEP, de->d_name);
+        if (!BatchAddFile (&fnames, &nfiles, &maxfiles, line))
+          break;
+      }
+    }
+    closedir (d);
+  }
+  else  // else, it should be a manifest
+  {
+    f = fopen (source, "r");
+    if (!f)
+    {
+      printf ("[%s] is neither a directory nor a manifest file.\n", source);
+      return 1;
+    }
+    while (fgets (line, sizeof line, f))
+    {
+      l = strlen (line);
+      while (l > 0 && (line[l-1] == '\n' || line[l-1] == '\r'))
+        line[--l] = '\0';
+      if (l > 0 && line[0] != '#')
+        if (!BatchAddFile (&fnames, &nfiles, &maxfiles, line))
+          break;
+    }
+    fclose (f);
+  }
+
+  if (nthreads <= 0)
+    nthreads = NumCPUs();
+
+  b.jobs = calloc (nfiles + 1, sizeof *b.jobs);
+  if (!b.jobs)
+    return nfiles;
+  for (i=0; i<nfiles; i++)
+    b.jobs[i].fname = fnames[i];
+  b.outdir = outdir;
+  b.opt = opt;
+  b.maxseconds = maxseconds;
+  b.scanonly = scanonly;
+  ModCacheInit (&cache, MODCACHESIZE);
+  b.cache = &cache;
+  MutexInit (&b.lockprint);
+  GetPhaseTable (opt->sfreq, opt->format);  // so workers find it already built
+  InitInterpTables();
+
+  printf ("%s %d modules with %d threads\n", scanonly? "Scanning" : "Rendering", nfiles, (nthreads < nfiles)? nthreads : nfiles);
+  tstart = TimerNow();
+  RunWorkPool (nthreads, nfiles, BatchRenderJob, &b);
+  telapsed = TimerNow() - tstart;
+
+  nfailed = 0;
+  totalsamples = 0;
+  for (i=0; i<nfiles; i++)
+  {
+    if (b.jobs[i].ok)
+      totalsamples += b.jobs[i].lsamples;
+    else
+      nfailed++;
+    free (fnames[i]);
+  }
+  free (fnames);
+  free (b.jobs);
+  MutexDestroy (&b.lockprint);
+  ModCacheFree (&cache);
+
+  tsong = totalsamples / opt->sfreq;
+  printf ("Total: %d modules (%d failed), %.0f samples (%.2f s of audio) in %.3f s\n",
+          nfiles, nfailed, totalsamples, tsong, telapsed);
+  if (telapsed > 0)
+    printf ("Throughput: %.2f modules/s, %.0f samples/s, %.1fx realtime\n",
+            (nfiles - nfailed) / telapsed, totalsamples / telapsed, tsong / telapsed);
+  return nfailed;
+}
+
+// Function: returns a checksum (32 bit FNV-1a) of l bytes at p
+static uint32_t Checksum (const uint8_t *p, size_t l)
+{
+  uint32_t h = 2166136261UL;
+
+  while (l--)
+    h = (h ^ *p++) * 16777619UL;
+  return h;
+}
+
+// Function: a and b are two players that were in step right before their
+// last tick, and were saved as they were then in preva and prevb. Finds out
+// which channel made them go apart: the first one that sounds different
+// when that tick is mixed again with that channel alone, or whose state
+// after the tick is different. bufa and bufb are scratch buffers for a
+// tick. Returns -1 if every channel on its own is the same (the difference
+// is in putting them together).
+static int DivergentChannel (const TModPlay *a, const TModPlay *b, const TModPlay *preva, const TModPlay *prevb, uint8_t *bufa, uint8_t *bufb)
+{
+  TModPlay ta, tb;
+  size_t n, lframe = OutputFrameSize (a->output);
+  int ch, k;
+
+  for (ch=0; ch<a->numchannels; ch++)
+    if (a->chan[ch].faseacum != b->chan[ch].faseacum || a->chan[ch].end != b->chan[ch].end)
+      return ch;
+  for (ch=0; ch<a->numchannels; ch++)
+  {
+    ta = *preva;
+    tb = *prevb;
+    n = SequenceTick (&ta);
+    SequenceTick (&tb);
+    for (k=0; k<ta.numchannels; k++)
+      if (k != ch)
+        ta.chan[k].sample = tb.chan[k].sample = NULL;  // muted
+    MixFrames (&ta, bufa, n);
+    MixFrames (&tb, bufb, n);
+    if (memcmp (bufa, bufb, n * lframe) != 0)
+      return ch;
+  }
+  return -1;
+}
+
+// Function: renders the MOD in mod tick by tick with the reference mixer,
+// and with mixer test, both with the options in opt, and compares the
+// checksum of each tick and the state of each channel after it. Stops at
+// the first tick where they differ, and reports where it is in the song,
+// and the channel to blame, to f. Rendering stops after maxseconds seconds
+// of audio (if not 0). The time each one took is stored in *tref and
+// *ttest. Returns 1 if both sound the same, 0 if they don't, or -1 if
+// there was no memory.
+int CompareMixers (const TModule *mod, TPlayOptions *opt, int test, uint32_t maxseconds, double *tref, double *ttest, FILE *f)
+{
+  TPlayOptions o = *opt;
+  TModPlay ref, tst, prevref, prevtst;
+  uint8_t *bufref, *buftst;
+  size_t nref, ntst, lframe, lbuf;
+  uint32_t frames = 0, ticks = 0, lmax;
+  double t;
+  int ch, same = 1;
+
+  o.stats = NULL;
+  o.startorder = 0;
+  o.startrow = 0;
+  o.mixer = MIXER_REFERENCE;
+  InitPlayMOD (&ref, mod, &o);
+  o.mixer = test;
+  InitPlayMOD (&tst, mod, &o);
+  lframe = OutputFrameSize (ref.output);
+  lbuf = MAXTICKFRAMES (ref.sfreq) * lframe;
+  bufref = malloc (lbuf);
+  buftst = malloc (lbuf);
+  if (!bufref || !buftst)
+  {
+    free (bufref);
+    free (buftst);
+    return -1;
+  }
+  lmax = (maxseconds > 0)? maxseconds * ref.sfreq : 0xFFFFFFFFUL;
+
+  *tref = *ttest = 0;
+  while (frames < lmax)
+  {
+    prevref = ref;
+    prevtst = tst;
+    t = TimerNow();
+    nref = RenderTick (&ref, bufref);
+    *tref += TimerNow() - t;
+    t = TimerNow();
+    ntst = RenderTick (&tst, buftst);
+    *ttest += TimerNow() - t;
+    if (nref == 0 && ntst == 0)
+      break;
+    for (ch=0; ch<ref.numchannels && ref.chan[ch].faseacum == tst.chan[ch].faseacum && ref.chan[ch].end == tst.chan[ch].end; ch++)
+      ;
+    if (nref != ntst || Checksum (bufref, nref * lframe) != Checksum (buftst, ntst * lframe) || ch < ref.numchannels)
+    {
+      same = 0;
+      ch = DivergentChannel (&ref, &tst, &prevref, &prevtst, bufref, buftst);
+      fprintf (f, "first difference at song position %d, division %d, tick %d (tick %lu, sample frame %lu), ",
+               ref.songpos, ref.patrow, ref.tick - 1, (unsigned long)ticks, (unsigned long)frames);
+      if (ch >= 0)
+        fprintf (f, "channel %d\n", ch + 1);
+      else
+        fprintf (f, "all channels mixed together\n");
+      break;
+    }
+    frames += nref;
+    ticks++;
+  }
+
+  free (bufref);
+  free (buftst);
+  return same;
+}
+
+// Function: the differential test. Renders the MOD in mod with every
+// optimized mixer this CPU can run, for every interpolation filter, and
+// compares each one tick by tick against the reference mixer (the original
+// sample by sample one) with CompareMixers(). What was found, and how much
+// faster each mixer is, goes to f. Returns 1 if all of them sound exactly
+// the same as the reference.
+int CompareMOD (const TModule *mod, TPlayOptions *opt, uint32_t maxseconds, FILE *f)
+{
+  TPlayOptions o = *opt;
+  double tref, ttest;
+  int mixer, interp, res, ok = 1;
+
+  for (interp=0; interp<NUMINTERPS; interp++)
+  {
+    o.interp = interp;
+    for (mixer=MIXER_REFERENCE+1; mixer<MIXER_AUTO; mixer++)
+    {
+      if (!MixerAvailable (mixer))
+        continue;
+      o.mixer = mixer;
+      fprintf (f, "%-6s vs ref, %-7s: ", mixernames[mixer], interpnames[interp]);
+      res = CompareMixers (mod, &o, mixer, maxseconds, &tref, &ttest, f);
+      if (res < 0)
+        return 0;
+      if (res == 1)
+        fprintf (f, "identical, %.2fx as fast (%.3f s vs %.3f s)\n", (ttest > 0)? tref / ttest : 0.0, ttest, tref);
+      else
+        ok = 0;
+    }
+  }
+  return ok;
+}
+
+// Synthetic modules for the benchmark (see BenchMOD()). Each one stresses
+// something: every channel playing a new note on every row, loops a few
+// bytes long, effects that change pitch or volume on every tick, the
+// shortest ticks there can be, the biggest samples a MOD can have, or
+// volumes above 64, in sample headers and Cxx, which must be clamped.
+typedef struct
+{
+  const char *name;
+  int numchannels;
+  int numsamples;
+  uint32_t lsample;   // bytes in each sample
+  uint32_t lloop;     // bytes in its loop, at its end. 0 for none
+  int effects;        // 1 to put a pitch or volume effect on every slot
+  int volume;         // of the samples, and the highest Cxx on every slot if not 64
+  int speed;          // ticks per division
+  int bpm;
+} TBenchCase;
+
+static const TBenchCase benchcases[] =
+{
+  {"allchannels",  32,  8,   8192, 8192, 0,  64, 6, 125},
+  {"tinyloops",    32,  8,     64,   16, 0,  64, 6, 125},
+  {"effects",       8,  8,   4096, 4096, 1,  64, 6, 125},
+  {"highbpm",       8,  8,   4096, 4096, 1,  64, 1, 255},
+  {"largesamples",  4, 31, 131070,    0, 0,  64, 6, 125},
+  {"loudvolumes",   8,  8,   4096, 4096, 0, 255, 6, 125},
+};
+#define NUMBENCHCASES (int)(sizeof benchcases / sizeof benchcases[0])
+
+// Song positions in each synthetic module, and different patterns
+#define BENCHSONGLENGTH 4
+
+// Each measure is repeated until it has taken this long, in seconds, and
+// the mixer is timed this many times, keeping the fastest one
+#define BENCHMINTIME 0.1
+#define BENCHRUNS 3
+
+// Function: returns the next number of a small pseudorandom sequence, so
+// every synthetic module is the same each time it is generated
+static uint32_t BenchRandom (uint32_t *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7FFF;
+}
+
+// Function: generates the MOD file for a benchmark case, as it would be on
+// disk. Stores its size in *lfich. Returns NULL if there was no memory.
+uint8_t *GenerateBenchMOD (const TBenchCase *bc, size_t *lfich)
+{
+  static const uint8_t effects[][2] = {{0x0, 0x37}, {0x4, 0x48}, {0x1, 0x02}, {0x2, 0x02}, {0x3, 0x08}, {0x7, 0x46}, {0xA, 0x01}, {0x6, 0x10}};
+  uint8_t *buffer, *p;
+  size_t lpatterns;
+  uint32_t seed = 1, i, loopstart;
+  int pat, row, ch, smp, period, effect, arg;
+
+  lpatterns = (size_t)BENCHSONGLENGTH * 64 * bc->numchannels * 4;
+  *lfich = 20 + 31*30 + 2 + 128 + 4 + lpatterns + (size_t)bc->numsamples * bc->lsample;
+  buffer = calloc (1, *lfich);
+  if (!buffer)
+    return NULL;
+  memcpy (buffer, bc->name, strlen (bc->name));
+  p = buffer + 20;
+  loopstart = bc->lsample - bc->lloop;
+  for (smp=0; smp<bc->numsamples; smp++, p+=30)
+  {
+    sprintf ((char *)p, "bench %d", smp+1);
+    p[22] = (bc->lsample/2) >> 8;
+    p[23] = (bc->lsample/2) & 0xFF;
+    p[24] = smp & 0xF;   // finetune
+    p[25] = bc->volume;
+    p[26] = ((bc->lloop? loopstart : 0)/2) >> 8;
+    p[27] = ((bc->lloop? loopstart : 0)/2) & 0xFF;
+    p[28] = ((bc->lloop? bc->lloop : 2)/2) >> 8;
+    p[29] = ((bc->lloop? bc->lloop : 2)/2) & 0xFF;
+  }
+  p = buffer + 20 + 31*30;
+  p[0] = BENCHSONGLENGTH;
+  p[1] = 127;
+  for (i=0; i<BENCHSONGLENGTH; i++)
+    p[2+i] = i;
+  p += 2 + 128;
+  if (bc->numchannels == 4)
+    memcpy (p, "M.K.", 4);
+  else if (bc->numchannels < 10)
+    sprintf ((char *)p, "%dCHN", bc->numchannels);
+  else
+    sprintf ((char *)p, "%dCH", bc->numchannels);
+  p += 4;
+
+  for (pat=0; pat<BENCHSONGLENGTH; pat++)
+  {
+    for (row=0; row<64; row++)
+    {
+      for (ch=0; ch<bc->numchannels; ch++, p+=4)
+      {
+        smp = 1 + BenchRandom (&seed) % bc->numsamples;
+        period = finetune_table[0][BenchRandom (&seed) % 36];
+        effect = 0;
+        arg = 0;
+        if (row == 0 && ch == 0)  // tempo is set at the start of every pattern
+        {
+          effect = 0xF;
+          arg = bc->speed;
+        }
+        else if (row == 0 && ch == 1)
+        {
+          effect = 0xF;
+          arg = bc->bpm;
+        }
+        else if (bc->effects)
+        {
+          effect = effects[(row + ch) % 8][0];
+          arg = effects[(row + ch) % 8][1];
+        }
+        else if (bc->volume != 64)
+        {
+          effect = 0xC;
+          arg = BenchRandom (&seed) % (bc->volume + 1);
+        }
+        p[0] = (smp & 0xF0) | (period >> 8);
+        p[1] = period & 0xFF;
+        p[2] = ((smp & 0xF) << 4) | effect;
+        p[3] = arg;
+      }
+    }
+  }
+
+  for (i=0; i<(uint32_t)bc->numsamples * bc->lsample; i++)  // noise, so nothing can be skipped as silence
+    p[i] = (uint8_t)BenchRandom (&seed);
+  return buffer;
+}
+
+// Function: runs a benchmark case, with the options in opt (all the
+// interpolation filters are tried, though), and writes its results to f as
+// a JSON object. Returns 1 if OK.
+static int BenchCase (const TBenchCase *bc, TPlayOptions *opt, FILE *f)
+{
+  TModule mod;
+  TModPlay mp;
+  TPlayOptions o = *opt;
+  uint8_t *filedata, *out;
+  size_t lfich, n;
+  uint32_t ticks = 0, frames = 0;
+  double tstart, t, best, tseq, loadmbps, ticksps;
+  long reps;
+  int interp, run;
+
+  filedata = GenerateBenchMOD (bc, &lfich);
+  out = malloc (RENDERBLOCKFRAMES * OutputFrameSize (opt->output));
+  if (!filedata || !out)
+  {
+    free (filedata);
+    free (out);
+    return 0;
+  }
+
+  // loader: parsing the file, as LoadMOD() does once it's mapped
+  tstart = TimerNow();
+  reps = 0;
+  do
+  {
+    memset (&mod, 0, sizeof mod);
+    if (ParseMOD (&mod, filedata, lfich, 1) != 1)
+    {
+      free (filedata);
+      free (out);
+      return 0;
+    }
+    reps++;
+    t = TimerNow() - tstart;
+    if (t < BENCHMINTIME)
+      FreeMOD (&mod);
+  }
+  while (t < BENCHMINTIME);
+  loadmbps = (double)lfich * reps / t / 1e6;
+
+  // sequencer: the whole song, tick by tick, with no mixing
+  o.stats = NULL;
+  tstart = TimerNow();
+  reps = 0;
+  do
+  {
+    InitPlayMOD (&mp, &mod, &o);
+    for (ticks = 0, frames = 0; (n = SequenceTick (&mp)) > 0; ticks++)
+      frames += n;
+    reps++;
+    t = TimerNow() - tstart;
+  }
+  while (t < BENCHMINTIME);
+  ticksps = (double)ticks * reps / t;
+  tseq = ticks / ticksps;  // what the sequencer takes of a song rendering
+
+  fprintf (f, "    {\"name\": \"%s\", \"channels\": %d, \"filebytes\": %lu, \"ticks\": %lu, \"frames\": %lu,\n",
+           bc->name, bc->numchannels, (unsigned long)lfich, (unsigned long)ticks, (unsigned long)frames);
+  fprintf (f, "     \"loader_mb_per_s\": %.1f, \"sequencer_ticks_per_s\": %.0f,\n", loadmbps, ticksps);
+  fprintf (f, "     \"mixer_ns_per_sample_channel\": {");
+
+  // mixer: the whole song rendered, for each filter. The time of the
+  // sequencer is taken off, so what is left is mixing and conversion
+  for (interp=0; interp<NUMINTERPS; interp++)
+  {
+    o.interp = interp;
+    best = 0;
+    for (run=0; run<BENCHRUNS; run++)
+    {
+      InitPlayMOD (&mp, &mod, &o);
+      tstart = TimerNow();
+      while (RenderFrames (&mp, out, RENDERBLOCKFRAMES) > 0)
+        ;
+      t = TimerNow() - tstart;
+      if (run == 0 || t < best)
+        best = t;
+    }
+    best = (best > tseq)? best - tseq : 0;
+    fprintf (f, "%s\"%s\": %.3f", (interp > 0)? ", " : "", interpnames[interp],
+             (frames > 0)? best * 1e9 / ((double)frames * bc->numchannels) : 0.0);
+    fprintf (stderr, "%-12s %-8s %.3f ns per sample and channel\n", bc->name, interpnames[interp],
+             (frames > 0)? best * 1e9 / ((double)frames * bc->numchannels) : 0.0);
+  }
+  fprintf (f, "}}");
+
+  FreeMOD (&mod);
+  free (filedata);
+  free (out);
+  return 1;
+}
+
+// Function: the benchmark. Generates a synthetic module for each case in
+// benchcases, and measures how fast it's loaded (MB/s), sequenced (ticks/s)
+// and mixed (ns per output sample and channel, for each filter), with the
+// sampling frequency, mixer and output format in opt. Results go to f as a
+// JSON document whose layout doesn't change from run to run, so results
+// can be compared by a script. Returns 1 if OK.
+int BenchMOD (TPlayOptions *opt, FILE *f)
+{
+  TPlayOptions o = *opt;
+  int i, ok = 1;
+
+  if (o.mixer == MIXER_AUTO || !MixerAvailable (o.mixer))
+    o.mixer = BestMixer();
+  if (o.output < 0 || o.output >= NUMOUTPUTS)
+    o.output = OUTPUT_U8MONO;
+  o.startorder = 0;
+  o.startrow = 0;
+  fprintf (f, "{\n  \"benchmark\": \"modplay\",\n  \"sfreq\": %lu, \"mixer\": \"%s\", \"output\": \"%s\",\n  \"cases\": [\n",
+           (unsigned long)o.sfreq, mixernames[o.mixer], outputnames[o.output]);
+  for (i=0; i<NUMBENCHCASES && ok; i++)
+  {
+    ok = BenchCase (&benchcases[i], &o, f);
+    fprintf (f, "%s\n", (i < NUMBENCHCASES-1)? "," : "");
+  }
+  fprintf (f, "  ]\n}\n");
+  return ok;
+}
+
+// Function: the mixer test (see CompareMOD()) run on the modules of the
+// benchmark, which have what songs at hand may not: 32 channels, loops of
+// a few bytes, or volumes above 64. Returns 1 if every mixer sounds the
+// same as the reference one for all of them.
+int CompareBench (TPlayOptions *opt, uint32_t maxseconds, FILE *f)
+{
+  TModule mod;
+  uint8_t *filedata;
+  size_t lfich;
+  int i, res, ok = 1;
+
+  for (i=0; i<NUMBENCHCASES; i++)
+  {
+    filedata = GenerateBenchMOD (&benchcases[i], &lfich);
+    if (!filedata)
+      return 0;
+    memset (&mod, 0, sizeof mod);
+    if (ParseMOD (&mod, filedata, lfich, 1) != 1)
+    {
+      free (filedata);
+      return 0;
+    }
+    res = CompareMOD (&mod, opt, maxseconds, f);
+    fprintf (f, "%s: %s\n", benchcases[i].name, res? "every mixer sounds the same as the reference" : "MIXERS DIFFER");
+    ok = ok && res;
+    FreeMOD (&mod);
+    free (filedata);
+  }
+  return ok;
+}
+
+// main function. Retrieves MOD file name and optional sampling frequency
+// from user arguments, then load the MOD, display some info about it, and then,
+// it starts playing it (in background). Meanwhile, the main function continues
+// in a loop printing new pattern divisions as they are being played, while
+// waiting for the song to finish or the user to press the ESC key.
+// If an output file is given with -w (WAV) or -r (raw PCM), the MOD is
+// rendered into it as fast as possible, instead of being played. With -b, a
+// whole directory or manifest of modules is rendered to WAV files.
+int main (int argc, char *argv[])
+{
+  static TModule mod;     // the complete MOD file as a structure
+  static TModPlay mplay;  // the current state of the MOD as we're playing
+  int res, i, tecla;
+  char fname[256] = "";
+  char outname[256] = "";
+  char batch[256] = "";
+  char outdir[256] = "";
+  char statsname[256] = "";
+  int nthreads = 0;
+  int wav = 0;
+  int scanonly = 0;
+  int bench = 0;
+  int compare = 0;
+  TSongScan scan;
+  static TPlayStats stats, snap;
+  double tstart, texport;
+  uint32_t maxseconds = 3600;  // an hour of audio is more than any sane MOD lasts
+  TPlayOptions opt;
+
+  DefaultPlayOptions (&opt);
+  for (i=1; i<argc; i++)
+  {
+    if (strlen(argv[i])>2 && argv[i][0]=='-')
+    {
+      switch (argv[i][1])
       {
       case 'f':
-        sfreq = atoi(argv[i]+2);
+        opt.sfreq = atoi(argv[i]+2);
+        break;
+      case 'm':  // mixer: ref, scalar, sse2, avx2 or auto
+        for (opt.mixer = 0; opt.mixer < MIXER_AUTO && stricmp (argv[i]+2, mixernames[opt.mixer]) != 0; opt.mixer++)
+          ;
+        break;
+      case 't':  // output format: u8, s16 or f32
+        for (opt.output = 0; opt.output < NUMOUTPUTS && stricmp (argv[i]+2, outputnames[opt.output]) != 0; opt.output++)
+          ;
+        break;
+      case 'i':  // interpolation: nearest, linear, cubic or sinc
+        for (opt.interp = 0; opt.interp < NUMINTERPS && stricmp (argv[i]+2, interpnames[opt.interp]) != 0; opt.interp++)
+          ;
+        break;
+      case 's':  // where to start: seconds, or song position and division
+        if (strchr (argv[i]+2, ':'))
+          sscanf (argv[i]+2, "%d:%d", &opt.startorder, &opt.startrow);
+        else
+        {
+          opt.startorder = -1;
+          opt.startms = (uint32_t)(atof(argv[i]+2) * 1000);
+        }
+        break;
+      case 'x':  // keep timing statistics, and export them to this file
+        strcpy (statsname, argv[i]+2);
+        break;
+      case 'h':  // how much audio to render ahead of the sound card, in milliseconds
+        opt.highwaterms = atoi(argv[i]+2);
+        break;
+      case 'u':  // unroll loops shorter than this many bytes
+        minlooplength = (atoi(argv[i]+2) > 0)? atoi(argv[i]+2) : 0;  // not a negative one, which would wrap around
+        break;
+      case 'p':  // stereo separation, 0 to 100
+        opt.separation = atoi(argv[i]+2);
+        break;
+      case 'w':  // render to a WAV file
+      case 'r':  // render to a raw PCM file
+        strcpy (outname, argv[i]+2);
+        wav = (argv[i][1] == 'w');
+        break;
+      case 'l':
+        maxseconds = atoi(argv[i]+2);
+        break;
+      case 'b':  // batch render a directory or manifest
+        strcpy (batch, argv[i]+2);
+        break;
+      case 'o':  // output directory for batch render
+        strcpy (outdir, argv[i]+2);
+        break;
+      case 'j':  // number of threads for batch render, or to render a single module
+        nthreads = atoi(argv[i]+2);
+        break;
+      case 'a':  // where audio goes when playing, instead of the sound card
+        if (!ElegirSalidaAudio (argv[i]+2))
+        {
+          printf ("Unknown audio sink %s. Aborting.\n", argv[i]+2);
+          return 1;
+        }
         break;
       }
     }
+    else if (strcmp (argv[i], "-d") == 0)  // just tell how long the song lasts
+      scanonly = 1;
+    else if (strcmp (argv[i], "-B") == 0)  // run the benchmark
+      bench = 1;
+    else if (strcmp (argv[i], "-C") == 0)  // compare every mixer against the reference one
+      compare = 1;
     else
       strcpy (fname, argv[i]);
   }
+  if (bench)
+    return (BenchMOD (&opt, stdout) == 1)? 0 : 1;
+  if (batch[0] != 0)
+    return (BatchRenderMOD (batch, (outdir[0] != 0)? outdir : NULL, nthreads, &opt, maxseconds, scanonly) == 0)? 0 : 1;
+
+  if (compare && fname[0] == 0)
+    return (CompareBench (&opt, maxseconds, stdout) == 1)? 0 : 1;
+
   if (fname[0] == 0)
   {
     printf ("Need MOD file name. Aborting.\n");
@@ -1019,19 +4640,64 @@ int main (int argc, char *argv[])
   if (strlen(fname)<4 || stricmp (fname + strlen(fname) - 4, ".MOD")!=0)
     strcat (fname, ".MOD");
 
-  res = LoadMOD (fname);
+  if (outname[0] != 0 || scanonly || compare)
+    res = LoadMOD (&mod, fname);
+  else
+    res = LoadMODProgressive (&mod, fname);  // to start playing as soon as possible
   if (res != 1)
   {
     printf ("[%s] module not found, or error during loading.\n", fname);
     return 0;
   }
 
-  InfoMOD ();
-  if (BeginPlayMOD (sfreq) != 1)
+  if (scanonly)
+  {
+    tstart = TimerNow();
+    res = ScanMOD (&mod, &opt, &scan);
+    if (res)
+    {
+      printf ("%s: ", fname);
+      PrintScan (stdout, &scan, opt.sfreq);
+      printf (". Scanned in %.3f ms\n", (TimerNow() - tstart) * 1000);
+    }
+    FreeMOD (&mod);
+    return (res == 1)? 0 : 1;
+  }
+
+  if (compare)
+  {
+    res = CompareMOD (&mod, &opt, maxseconds, stdout);
+    printf ("%s: %s\n", fname, res? "every mixer sounds the same as the reference" : "MIXERS DIFFER");
+    FreeMOD (&mod);
+    return (res == 1)? 0 : 1;
+  }
+
+  if (statsname[0] != 0)
+    opt.stats = &stats;
+
+  if (outname[0] != 0)
+  {
+    res = RenderMOD (&mod, outname, wav, &opt, maxseconds, nthreads);
+    if (statsname[0] != 0)
+      ExportPlayStats (&stats, statsname);
+    FreeMOD (&mod);
+    return (res == 1)? 0 : 1;
+  }
+
+  InfoMOD (&mod);
+  if (ScanMOD (&mod, &opt, &scan))
+  {
+    printf ("Duration: ");
+    PrintScan (stdout, &scan, opt.sfreq);
+    printf ("\n");
+  }
+  if (BeginPlayMOD (&mplay, &mod, &opt) != 1)
   {
     printf ("ERROR opening audio device.\n");
+    FreeMOD (&mod);
     return 0;
   }
+  printf ("Latency: %u ms rendered ahead, plus %d blocks of %d ms in the sound card\n", (unsigned)((uint64_t)mplay.playback->highwater / OutputFrameSize (opt.output) * 1000 / opt.sfreq), MAXAUDIOBUFFERS, PLAYBLOCKMS);
 
   // Now the MOD has begun playing in the background.
   // We can monitor it by peeking values from mplay variable.
@@ -1040,13 +4706,20 @@ int main (int argc, char *argv[])
   // we print it ahead.
   // Once the row has been printed, we must reset mplay.newrow and wait for it
   // to be setted again.
-  PrintRow (mod.Songpositions[0], 0);
+  PrintRow (&mod, mod.Songpositions[0], 0);
   mplay.newrow = 0;
-  while (mplay.finished == 0)
+  texport = TimerNow();
+  while (PlayingMOD (&mplay))
   {
+    if (statsname[0] != 0 && TimerNow() - texport >= 1)  // a fresh snapshot every second
+    {
+      GetPlayStats (&mplay, &snap);
+      ExportPlayStats (&snap, statsname);
+      texport = TimerNow();
+    }
     if (mplay.newrow == 1)
     {
-      PrintRow (mod.Songpositions[mplay.songpos], mplay.patrow);
+      PrintRow (&mod, mod.Songpositions[mplay.songpos], mplay.patrow);
       mplay.newrow = 0;
     }
     if (_kbhit())
@@ -1054,14 +4727,22 @@ int main (int argc, char *argv[])
       tecla = _getch();
       if (tecla == 27)
         break;
-      if (tecla == 'a' && mplay.songpos != mod.Songlength-1)
-      {
-        mplay.newsongpos = mplay.songpos + 1;
-        mplay.newpatrow = 0;
-      }
+      if (tecla == 'a' && mplay.songpos < mod.Songlength-1)  // next song position
+        AtomicStore (&mplay.seekorder, mplay.songpos + 1);
+      if (tecla == 'z' && mplay.songpos > 0)  // previous song position
+        AtomicStore (&mplay.seekorder, mplay.songpos - 1);
     }
   }
 
-  EndPlayMOD();
+  if (statsname[0] != 0)
+  {
+    GetPlayStats (&mplay, &snap);
+    ExportPlayStats (&snap, statsname);
+    printf ("CPU load: %.2f%% average, %.1f%% peak. %lu late ticks, %ld underruns\n",
+            (snap.audions > 0)? 100.0 * snap.renderns / snap.audions : 0.0, snap.peakload / 10.0,
+            (unsigned long)snap.lateticks, snap.underruns);
+  }
+  EndPlayMOD (&mplay);
+  FreeMOD (&mod);
   return 0;
 }
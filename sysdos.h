@@ -0,0 +1,154 @@
+#ifndef __SYSDOS_H__
+#define __SYSDOS_H__
+
+#include <stdio.h>
+#include <conio.h>
+#include <mem.h>
+#include <io.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <direct.h>
+#include <i86.h>
+
+#define PATHSEP '\\'
+
+// DOS runs a single thread. These are here so code that uses threads still
+// builds: ThreadCreate() always fails, and callers must be prepared to do
+// all the work on their own thread (which they should do anyway).
+typedef int THandle;
+typedef int TMutex;
+typedef int TEvent;
+typedef void (*TThreadFunc)(void *);
+
+// Function: returns a wall clock timestamp, in seconds. Under DOS there is
+// nothing else running, so processor time is as good as wall time.
+double TimerNow (void)
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Function: switches a stream (namely, stdout) to binary mode, so audio
+// data is not mangled by CR/LF translation.
+void SetBinaryMode (FILE *f)
+{
+  setmode (fileno(f), O_BINARY);
+}
+
+int ThreadCreate (THandle *t, TThreadFunc func, void *arg)
+{
+  return 0;
+}
+
+void ThreadJoin (THandle t)
+{
+}
+
+void ThreadYield (void)
+{
+}
+
+void MutexInit (TMutex *m)
+{
+}
+
+void MutexDestroy (TMutex *m)
+{
+}
+
+void MutexLock (TMutex *m)
+{
+}
+
+void MutexUnlock (TMutex *m)
+{
+}
+
+void EventInit (TEvent *e)
+{
+}
+
+void EventDestroy (TEvent *e)
+{
+}
+
+void EventSignal (TEvent *e)
+{
+}
+
+void EventWait (TEvent *e)
+{
+}
+
+// Atomic operations. There is just one thread, but the Sound Blaster
+// interrupt may come in between the read and the write of a variable, so
+// interrupts are disabled while both are done.
+long AtomicLoad (volatile long *p)
+{
+  return *p;
+}
+
+void AtomicStore (volatile long *p, long v)
+{
+  *p = v;
+}
+
+long AtomicAdd (volatile long *p, long v)
+{
+  long r;
+
+  _disable ();
+  r = (*p += v);
+  _enable ();
+  return r;
+}
+
+long AtomicSwap (volatile long *p, long v)
+{
+  long r;
+
+  _disable ();
+  r = *p;
+  *p = v;
+  _enable ();
+  return r;
+}
+
+int NumCPUs (void)
+{
+  return 1;
+}
+
+// Function: there is no memory mapping in DOS, so the whole file is read
+// into a single memory block instead.
+void *MapFile (const char *fname, size_t *size)
+{
+  FILE *f;
+  void *p;
+  long l;
+
+  f = fopen (fname, "rb");
+  if (!f)
+    return NULL;
+  fseek (f, 0, SEEK_END);
+  l = ftell (f);
+  fseek (f, 0, SEEK_SET);
+  p = (l > 0)? malloc (l) : NULL;
+  if (p != NULL && fread (p, 1, l, f) != (size_t)l)
+  {
+    free (p);
+    p = NULL;
+  }
+  fclose (f);
+  if (p != NULL)
+    *size = l;
+  return p;
+}
+
+// Function: releases a file loaded with MapFile()
+void UnmapFile (void *p, size_t size)
+{
+  free (p);
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef __SYSLNX_H__
+#define __SYSLNX_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <termios.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define stricmp strcasecmp
+#define strnicmp strncasecmp
+#define PATHSEP '/'
+
+typedef pthread_t THandle;
+typedef pthread_mutex_t TMutex;
+typedef void (*TThreadFunc)(void *);
+
+// An event a thread can wait for until another one signals it. Signals
+// don't pile up: many of them before a wait wake it just once.
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int signalled;
+} TEvent;
+
+// What a new thread needs to know to call the user function
+typedef struct
+{
+  TThreadFunc func;
+  void *arg;
+} TThreadStart;
+
+// Function: returns a wall clock timestamp, in seconds. Only differences
+// between two timestamps are meaningful.
+double TimerNow (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function: nothing to do here. POSIX streams are always binary.
+void SetBinaryMode (FILE *f)
+{
+}
+
+static void *ThreadTrampoline (void *p)
+{
+  TThreadStart ts = *(TThreadStart *)p;
+
+  free (p);
+  ts.func (ts.arg);
+  return NULL;
+}
+
+// Function: starts a new thread running func(arg). Returns 1 if the thread
+// could be created.
+int ThreadCreate (THandle *t, TThreadFunc func, void *arg)
+{
+  TThreadStart *ts = malloc (sizeof *ts);
+
+  if (!ts)
+    return 0;
+  ts->func = func;
+  ts->arg = arg;
+  if (pthread_create (t, NULL, ThreadTrampoline, ts) != 0)
+  {
+    free (ts);
+    return 0;
+  }
+  return 1;
+}
+
+// Function: waits for a thread created with ThreadCreate() to finish
+void ThreadJoin (THandle t)
+{
+  pthread_join (t, NULL);
+}
+
+// Function: gives the rest of the time slice to other threads
+void ThreadYield (void)
+{
+  sched_yield ();
+}
+
+void MutexInit (TMutex *m)
+{
+  pthread_mutex_init (m, NULL);
+}
+
+void MutexDestroy (TMutex *m)
+{
+  pthread_mutex_destroy (m);
+}
+
+void MutexLock (TMutex *m)
+{
+  pthread_mutex_lock (m);
+}
+
+void MutexUnlock (TMutex *m)
+{
+  pthread_mutex_unlock (m);
+}
+
+void EventInit (TEvent *e)
+{
+  pthread_mutex_init (&e->lock, NULL);
+  pthread_cond_init (&e->cond, NULL);
+  e->signalled = 0;
+}
+
+void EventDestroy (TEvent *e)
+{
+  pthread_cond_destroy (&e->cond);
+  pthread_mutex_destroy (&e->lock);
+}
+
+void EventSignal (TEvent *e)
+{
+  pthread_mutex_lock (&e->lock);
+  e->signalled = 1;
+  pthread_cond_signal (&e->cond);
+  pthread_mutex_unlock (&e->lock);
+}
+
+void EventWait (TEvent *e)
+{
+  pthread_mutex_lock (&e->lock);
+  while (!e->signalled)
+    pthread_cond_wait (&e->cond, &e->lock);
+  e->signalled = 0;
+  pthread_mutex_unlock (&e->lock);
+}
+
+// Atomic operations on a long shared between threads. All of them are
+// sequentially consistent. AtomicAdd() returns the new value, and
+// AtomicSwap() the old one.
+long AtomicLoad (volatile long *p)
+{
+  return __atomic_load_n (p, __ATOMIC_SEQ_CST);
+}
+
+void AtomicStore (volatile long *p, long v)
+{
+  __atomic_store_n (p, v, __ATOMIC_SEQ_CST);
+}
+
+long AtomicAdd (volatile long *p, long v)
+{
+  return __atomic_add_fetch (p, v, __ATOMIC_SEQ_CST);
+}
+
+long AtomicSwap (volatile long *p, long v)
+{
+  return __atomic_exchange_n (p, v, __ATOMIC_SEQ_CST);
+}
+
+// Function: returns how many processors are available to run threads
+int NumCPUs (void)
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return (n > 0)? n : 1;
+}
+
+// Function: maps a whole file into memory, and stores its size in *size.
+// The mapping is private: pages written to are copied, and the file is
+// never changed. Returns NULL if the file cannot be mapped (or is empty).
+// LoadMOD() only reads it while parsing, as samples are copied out of it.
+void *MapFile (const char *fname, size_t *size)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  fd = open (fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) != 0 || st.st_size == 0)
+  {
+    close (fd);
+    return NULL;
+  }
+  p = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);  // the mapping stays valid after closing the file
+  if (p == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  return p;
+}
+
+// Function: releases a file mapped with MapFile()
+void UnmapFile (void *p, size_t size)
+{
+  munmap (p, size);
+}
+
+static struct termios teclado_original;
+static int teclado_crudo = 0;
+
+// Function: restores the terminal to the state it had before the first key
+// poll. Registered with atexit()
+static void RestaurarTeclado (void)
+{
+  tcsetattr (STDIN_FILENO, TCSANOW, &teclado_original);
+}
+
+// Function: puts the terminal in non canonical mode, so keypresses can be
+// read as soon as they are typed, as DOS and Windows do.
+static void ModoTecladoCrudo (void)
+{
+  struct termios t;
+
+  if (teclado_crudo || !isatty (STDIN_FILENO))
+    return;
+  tcgetattr (STDIN_FILENO, &teclado_original);
+  t = teclado_original;
+  t.c_lflag &= ~(ICANON | ECHO);
+  tcsetattr (STDIN_FILENO, TCSANOW, &t);
+  atexit (RestaurarTeclado);
+  teclado_crudo = 1;
+}
+
+// Function: conio.h replacement. Returns non zero if a key is waiting to be read
+int _kbhit (void)
+{
+  fd_set fds;
+  struct timeval tv = {0, 0};
+
+  ModoTecladoCrudo ();
+  FD_ZERO (&fds);
+  FD_SET (STDIN_FILENO, &fds);
+  return select (STDIN_FILENO+1, &fds, NULL, NULL, &tv) > 0;
+}
+
+// Function: conio.h replacement. Reads a key without echoing it
+int _getch (void)
+{
+  unsigned char c;
+  int res;
+
+  ModoTecladoCrudo ();
+  res = read (STDIN_FILENO, &c, 1);
+  return (res == 1)? c : -1;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifdef WIN32
+#include "syswin.h"
+#elif defined(__linux__)
+#include "syslnx.h"
+#else
+#include "sysdos.h"
+#endif
@@ -0,0 +1,196 @@
+#ifndef __SYSWIN_H__
+#define __SYSWIN_H__
+
+#include <stdio.h>
+#include <conio.h>
+#include <mem.h>
+#include <io.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <windows.h>
+
+#define PATHSEP '\\'
+
+typedef HANDLE THandle;
+typedef CRITICAL_SECTION TMutex;
+typedef void (*TThreadFunc)(void *);
+typedef HANDLE TEvent;   // an auto reset event
+
+// What a new thread needs to know to call the user function
+typedef struct
+{
+  TThreadFunc func;
+  void *arg;
+} TThreadStart;
+
+// Function: returns a wall clock timestamp, in seconds. Only differences
+// between two timestamps are meaningful.
+double TimerNow (void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+// Function: switches a stream (namely, stdout) to binary mode, so audio
+// data is not mangled by CR/LF translation.
+void SetBinaryMode (FILE *f)
+{
+  _setmode (_fileno(f), _O_BINARY);
+}
+
+static DWORD WINAPI ThreadTrampoline (LPVOID p)
+{
+  TThreadStart ts = *(TThreadStart *)p;
+
+  free (p);
+  ts.func (ts.arg);
+  return 0;
+}
+
+// Function: starts a new thread running func(arg). Returns 1 if the thread
+// could be created.
+int ThreadCreate (THandle *t, TThreadFunc func, void *arg)
+{
+  TThreadStart *ts = malloc (sizeof *ts);
+
+  if (!ts)
+    return 0;
+  ts->func = func;
+  ts->arg = arg;
+  *t = CreateThread (NULL, 0, ThreadTrampoline, ts, 0, NULL);
+  if (*t == NULL)
+  {
+    free (ts);
+    return 0;
+  }
+  return 1;
+}
+
+// Function: waits for a thread created with ThreadCreate() to finish
+void ThreadJoin (THandle t)
+{
+  WaitForSingleObject (t, INFINITE);
+  CloseHandle (t);
+}
+
+// Function: gives the rest of the time slice to other threads
+void ThreadYield (void)
+{
+  Sleep (0);
+}
+
+void MutexInit (TMutex *m)
+{
+  InitializeCriticalSection (m);
+}
+
+void MutexDestroy (TMutex *m)
+{
+  DeleteCriticalSection (m);
+}
+
+void MutexLock (TMutex *m)
+{
+  EnterCriticalSection (m);
+}
+
+void MutexUnlock (TMutex *m)
+{
+  LeaveCriticalSection (m);
+}
+
+void EventInit (TEvent *e)
+{
+  *e = CreateEvent (NULL, FALSE, FALSE, NULL);
+}
+
+void EventDestroy (TEvent *e)
+{
+  CloseHandle (*e);
+}
+
+void EventSignal (TEvent *e)
+{
+  SetEvent (*e);
+}
+
+void EventWait (TEvent *e)
+{
+  WaitForSingleObject (*e, INFINITE);
+}
+
+// Atomic operations on a long shared between threads. Interlocked functions
+// are full barriers. AtomicAdd() returns the new value, and AtomicSwap()
+// the old one.
+long AtomicLoad (volatile long *p)
+{
+  return InterlockedCompareExchange (p, 0, 0);
+}
+
+void AtomicStore (volatile long *p, long v)
+{
+  InterlockedExchange (p, v);
+}
+
+long AtomicAdd (volatile long *p, long v)
+{
+  return InterlockedExchangeAdd (p, v) + v;
+}
+
+long AtomicSwap (volatile long *p, long v)
+{
+  return InterlockedExchange (p, v);
+}
+
+// Function: returns how many processors are available to run threads
+int NumCPUs (void)
+{
+  SYSTEM_INFO si;
+
+  GetSystemInfo (&si);
+  return (si.dwNumberOfProcessors > 0)? si.dwNumberOfProcessors : 1;
+}
+
+// Function: maps a whole file into memory, and stores its size in *size.
+// The mapping is copy on write: pages written to are copied, and the file
+// is never changed. Returns NULL if the file cannot be mapped (or is empty).
+// LoadMOD() only reads it while parsing, as samples are copied out of it.
+void *MapFile (const char *fname, size_t *size)
+{
+  HANDLE hf, hmap;
+  LARGE_INTEGER lf;
+  void *p;
+
+  hf = CreateFile (fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hf == INVALID_HANDLE_VALUE)
+    return NULL;
+  if (!GetFileSizeEx (hf, &lf) || lf.QuadPart == 0)
+  {
+    CloseHandle (hf);
+    return NULL;
+  }
+  hmap = CreateFileMapping (hf, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  CloseHandle (hf);
+  if (hmap == NULL)
+    return NULL;
+  p = MapViewOfFile (hmap, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle (hmap);  // the view keeps the mapping alive
+  if (p == NULL)
+    return NULL;
+  *size = (size_t)lf.QuadPart;
+  return p;
+}
+
+// Function: releases a file mapped with MapFile()
+void UnmapFile (void *p, size_t size)
+{
+  UnmapViewOfFile (p);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __WAVFILE_H__
+#define __WAVFILE_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// Size of the RIFF header written by WriteWavHeader(). Audio data follows it.
+#define WAVHEADERSIZE 44
+
+static void WriteLE16 (uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v>>8) & 0xFF;
+}
+
+static void WriteLE32 (uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v>>8) & 0xFF;
+  p[2] = (v>>16) & 0xFF;
+  p[3] = (v>>24) & 0xFF;
+}
+
+// Function: writes a canonical 44 byte RIFF/WAVE header for PCM audio to f
+// at its current position. If isfloat is 1, samples are IEEE floating point
+// numbers instead of integers. ldata is the size in bytes of the audio data that
+// follows. If it isn't known yet (writing to a pipe, for instance), use
+// 0xFFFFFFFF and, if the stream is seekable, write the header again once the
+// size is known. Returns 1 if the header was fully written.
+int WriteWavHeader (FILE *f, uint32_t sfreq, int nchannels, int bits, int isfloat, uint32_t ldata)
+{
+  uint8_t h[WAVHEADERSIZE];
+  uint32_t lriff;
+
+  lriff = (ldata > 0xFFFFFFFFUL - (WAVHEADERSIZE-8))? 0xFFFFFFFFUL : ldata + WAVHEADERSIZE-8;
+  memcpy (h, "RIFF", 4);
+  WriteLE32 (h+4, lriff);
+  memcpy (h+8, "WAVEfmt ", 8);
+  WriteLE32 (h+16, 16);                              // size of fmt chunk
+  WriteLE16 (h+20, isfloat? 3 : 1);                  // IEEE float or PCM
+  WriteLE16 (h+22, nchannels);
+  WriteLE32 (h+24, sfreq);
+  WriteLE32 (h+28, sfreq * nchannels * bits / 8);    // bytes per second
+  WriteLE16 (h+32, nchannels * bits / 8);            // block align
+  WriteLE16 (h+34, bits);
+  memcpy (h+36, "data", 4);
+  WriteLE32 (h+40, ldata);
+  return fwrite (h, 1, WAVHEADERSIZE, f) == WAVHEADERSIZE;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <stdlib.h>
+#include "system.h"
+
+// A small work-stealing thread pool. Jobs are just numbers from 0 to
+// njobs-1, and the same user function is called for all of them. Each
+// worker owns a queue of jobs: it takes jobs from the back of its own queue,
+// and when it runs out of them, it steals from the front of some other
+// worker's queue. Long and short jobs thus end up evenly spread over all the
+// workers without any central queue everyone has to fight for.
+// The thread that calls RunWorkPool() is worker 0, so if no thread can be
+// created (as in DOS), all jobs still get done.
+
+typedef void (*TWorkFunc)(int job, int worker, void *data);
+
+// Queue of pending jobs for a worker
+typedef struct
+{
+  TMutex lock;
+  int *jobs;
+  int first;   // next job a thief would steal
+  int last;    // one past the next job the owner would take
+} TWorkQueue;
+
+// The pool itself
+typedef struct
+{
+  int nworkers;
+  TWorkQueue *queues;
+  TWorkFunc func;
+  void *data;
+} TWorkPool;
+
+// What each thread needs to know to do its work
+typedef struct
+{
+  TWorkPool *pool;
+  int worker;
+} TWorker;
+
+// Function: takes the job at the back of a queue. Returns -1 if it was empty
+static int WorkQueuePop (TWorkQueue *q)
+{
+  int job = -1;
+
+  MutexLock (&q->lock);
+  if (q->last > q->first)
+    job = q->jobs[--q->last];
+  MutexUnlock (&q->lock);
+  return job;
+}
+
+// Function: takes the job at the front of a queue. Returns -1 if it was empty
+static int WorkQueueSteal (TWorkQueue *q)
+{
+  int job = -1;
+
+  MutexLock (&q->lock);
+  if (q->last > q->first)
+    job = q->jobs[q->first++];
+  MutexUnlock (&q->lock);
+  return job;
+}
+
+// Function: main loop for each worker. Jobs never create new jobs, so once
+// every queue has been found empty, there is nothing left to do.
+static void WorkerLoop (void *p)
+{
+  TWorker *w = p;
+  TWorkPool *pool = w->pool;
+  int job, i;
+
+  while (1)
+  {
+    job = WorkQueuePop (&pool->queues[w->worker]);
+    for (i=1; job < 0 && i < pool->nworkers; i++)  // our queue is empty. Go stealing, starting with our neighbour
+      job = WorkQueueSteal (&pool->queues[(w->worker + i) % pool->nworkers]);
+    if (job < 0)
+      break;
+    pool->func (job, w->worker, pool->data);
+  }
+}
+
+// Function: runs func(job, worker, data) for every job from 0 to njobs-1,
+// using up to nworkers threads (the calling one included). Jobs are dealt
+// round robin to the workers to begin with. Returns when all jobs are done,
+// or 0 if there wasn't memory to set up the pool.
+int RunWorkPool (int nworkers, int njobs, TWorkFunc func, void *data)
+{
+  TWorkPool pool;
+  TWorker *workers;
+  THandle *threads;
+  int *started;
+  int i, ok = 0;
+
+  if (nworkers < 1)
+    nworkers = 1;
+  if (nworkers > njobs && njobs > 0)
+    nworkers = njobs;
+
+  pool.nworkers = nworkers;
+  pool.func = func;
+  pool.data = data;
+  pool.queues = calloc (nworkers, sizeof *pool.queues);
+  workers = calloc (nworkers, sizeof *workers);
+  threads = calloc (nworkers, sizeof *threads);
+  started = calloc (nworkers, sizeof *started);
+  if (pool.queues && workers && threads && started)
+  {
+    for (i=0; i<nworkers && (pool.queues[i].jobs = malloc ((njobs/nworkers + 1) * sizeof (int))); i++)
+      MutexInit (&pool.queues[i].lock);
+    ok = (i == nworkers);
+    if (ok)
+    {
+      for (i=0; i<njobs; i++)  // deal jobs
+      {
+        TWorkQueue *q = &pool.queues[i % nworkers];
+        q->jobs[q->last++] = i;
+      }
+      for (i=0; i<nworkers; i++)
+      {
+        workers[i].pool = &pool;
+        workers[i].worker = i;
+      }
+      for (i=1; i<nworkers; i++)
+        started[i] = ThreadCreate (&threads[i], WorkerLoop, &workers[i]);
+      WorkerLoop (&workers[0]);
+      for (i=1; i<nworkers; i++)
+        if (started[i])
+          ThreadJoin (threads[i]);
+    }
+    for (i=0; i<nworkers; i++)
+    {
+      if (pool.queues[i].jobs)
+      {
+        MutexDestroy (&pool.queues[i].lock);
+        free (pool.queues[i].jobs);
+      }
+    }
+  }
+  free (pool.queues);
+  free (workers);
+  free (threads);
+  free (started);
+  return ok;
+}
+
+#endif